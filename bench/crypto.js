@@ -0,0 +1,31 @@
+/* crypto box messages over tcp: sealed with tcpsendstr, opened with
+   tcprecvsecret, under the default context's keypair */
+
+const Sampler = require('./stats')
+
+const sizes = [16, 256, 4096]
+
+module.exports = function crypto (lib, opts, report) {
+  const ipaddr = lib.iplocal(44462)
+  const ls = lib.tcplisten(ipaddr)
+  const cs = lib.tcpconnect(ipaddr)
+  const as = lib.tcpaccept(ls)
+  const n = opts.quick ? 1000 : 10000
+
+  sizes.forEach(function (size) {
+    const str = 'c'.repeat(size)
+    const s = new Sampler(n)
+    for (var i = 0; i < n; i++) {
+      const t0 = s.time()
+      const sz = lib.tcpsendstr(as, str)
+      lib.tcpflush(as)
+      lib.tcprecvsecret(cs, sz)
+      s.done(t0, size)
+    }
+    report(s.result('crypto sendstr', size, 1))
+  })
+
+  lib.tcpclose(cs)
+  lib.tcpclose(as)
+  lib.tcpclose(ls)
+}
@@ -0,0 +1,34 @@
+/* node bench [tcp|udp|unix|crypto ...] [--quick], JSON results on stdout */
+
+const lib = require('..')
+const os = require('os')
+
+const args = process.argv.slice(2)
+const quick = args.indexOf('--quick') >= 0
+const only = args.filter(function (a) { return a[0] !== '-' })
+
+const suites = {
+  tcp: require('./tcp'),
+  udp: require('./udp'),
+  unix: require('./unix'),
+  crypto: require('./crypto')
+}
+
+const results = []
+Object.keys(suites).forEach(function (name) {
+  if (only.length && only.indexOf(name) < 0)
+    return
+  suites[name](lib, { quick: quick }, function (r) {
+    results.push(r)
+    process.stderr.write(`${r.bench} size=${r.size} conns=${r.conns} ` +
+      `p50=${r.p50}us p99=${r.p99}us p999=${r.p999}us ${r.mbps}MB/s\n`)
+  })
+})
+
+process.stdout.write(JSON.stringify({
+  node: process.version,
+  arch: process.arch,
+  cpus: os.cpus().length,
+  quick: quick,
+  results: results
+}, null, 2) + '\n')
@@ -0,0 +1,46 @@
+/* latency samples in ns, timed one operation at a time */
+
+module.exports = Sampler
+
+function Sampler (n) {
+  this.ns = new Float64Array(n)
+  this.n = 0
+  this.bytes = 0
+  this.start = process.hrtime()
+}
+
+Sampler.prototype.time = function () {
+  return process.hrtime()
+}
+
+Sampler.prototype.done = function (t0, bytes) {
+  const d = process.hrtime(t0)
+  this.ns[this.n++] = d[0] * 1e9 + d[1]
+  this.bytes += bytes
+}
+
+/* { bench, size, conns, n, p50, p99, p999 } in us, mbps over the whole run */
+Sampler.prototype.result = function (bench, size, conns) {
+  const d = process.hrtime(this.start)
+  const secs = d[0] + d[1] / 1e9
+  const ns = this.ns.subarray(0, this.n).sort()
+
+  function pct (p) {
+    if (!ns.length)
+      return 0
+    const i = Math.min(ns.length - 1, Math.floor(ns.length * p))
+    return Math.round(ns[i] / 10) / 100
+  }
+
+  return {
+    bench: bench,
+    size: size,
+    conns: conns,
+    n: this.n,
+    p50: pct(0.5),
+    p99: pct(0.99),
+    p999: pct(0.999),
+    mbps: Math.round(this.bytes / secs / 1e4) / 100,
+    ops: Math.round(this.n / secs)
+  }
+}
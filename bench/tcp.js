@@ -0,0 +1,72 @@
+/* tcp ping-pong over 1..64 connections, and one-way streaming */
+
+const Sampler = require('./stats')
+
+const sizes = [16, 256, 4096, 65536]
+const conns = [1, 8, 64]
+
+module.exports = function tcp (lib, opts, report) {
+  const ipaddr = lib.iplocal(44460)
+  const ls = lib.tcplisten(ipaddr, 128)
+
+  conns.forEach(function (c) {
+    const pairs = connect(lib, ls, ipaddr, c)
+    sizes.forEach(function (size) {
+      report(pingpong(lib, pairs, size, opts.quick ? 1000 : 10000))
+    })
+    pairs.forEach(function (p) {
+      lib.tcpclose(p.cs)
+      lib.tcpclose(p.as)
+    })
+  })
+
+  const pair = connect(lib, ls, ipaddr, 1)[0]
+  sizes.forEach(function (size) {
+    report(stream(lib, pair, size, (opts.quick ? 16 : 256) << 20))
+  })
+  lib.tcpclose(pair.cs)
+  lib.tcpclose(pair.as)
+  lib.tcpclose(ls)
+}
+
+function connect (lib, ls, ipaddr, n) {
+  const pairs = []
+  while (n--) {
+    const cs = lib.tcpconnect(ipaddr)
+    pairs.push({ cs: cs, as: lib.tcpaccept(ls) })
+  }
+  return pairs
+}
+
+/* a full round trip per sample, connections taken in turn */
+function pingpong (lib, pairs, size, n) {
+  const msg = new Buffer(size).fill('p')
+  const s = new Sampler(n)
+  for (var i = 0; i < n; i++) {
+    const p = pairs[i % pairs.length]
+    const t0 = s.time()
+    lib.tcpsend(p.cs, msg)
+    lib.tcpflush(p.cs)
+    lib.tcprecv(p.as, size)
+    lib.tcpsend(p.as, msg)
+    lib.tcpflush(p.as)
+    lib.tcprecv(p.cs, size)
+    s.done(t0, 2 * size)
+  }
+  return s.result('tcp pingpong', size, pairs.length)
+}
+
+/* one message per sample, sent and then drained on the other end */
+function stream (lib, pair, size, total) {
+  const msg = new Buffer(size).fill('s')
+  const n = Math.max(1, Math.floor(total / size))
+  const s = new Sampler(n)
+  for (var i = 0; i < n; i++) {
+    const t0 = s.time()
+    lib.tcpsend(pair.cs, msg)
+    lib.tcpflush(pair.cs)
+    lib.release(lib.tcprecv(pair.as, size))
+    s.done(t0, size)
+  }
+  return s.result('tcp stream', size, 1)
+}
@@ -0,0 +1,23 @@
+/* udp packets per second over loopback, one send and recv per sample */
+
+const Sampler = require('./stats')
+
+const sizes = [16, 512, 1400]
+
+module.exports = function udp (lib, opts, report) {
+  const ipaddr = lib.iplocal(44461)
+  const ls = lib.udplisten(ipaddr)
+  const n = opts.quick ? 10000 : 100000
+
+  sizes.forEach(function (size) {
+    const msg = new Buffer(size).fill('u')
+    const s = new Sampler(n)
+    for (var i = 0; i < n; i++) {
+      const t0 = s.time()
+      lib.udpsend(ls, ipaddr, msg)
+      lib.udprecv(ls, size, 10)
+      s.done(t0, size)
+    }
+    report(s.result('udp packets', size, 1))
+  })
+}
@@ -0,0 +1,55 @@
+/* unix socket ping-pong, and the shared memory rings where there are any */
+
+const Sampler = require('./stats')
+
+const sizes = [16, 256, 4096, 65536]
+const path = '/tmp/mill-bench.sock'
+
+module.exports = function unix (lib, opts, report) {
+  const n = opts.quick ? 1000 : 10000
+  const ls = lib.unixlisten(path)
+  const cs = lib.unixconnect(path)
+  const as = lib.unixaccept(ls)
+
+  sizes.forEach(function (size) {
+    const msg = new Buffer(size).fill('x')
+    const s = new Sampler(n)
+    for (var i = 0; i < n; i++) {
+      const t0 = s.time()
+      lib.unixsend(cs, msg)
+      lib.unixflush(cs)
+      lib.unixrecv(as, size)
+      lib.unixsend(as, msg)
+      lib.unixflush(as)
+      lib.unixrecv(cs, size)
+      s.done(t0, 2 * size)
+    }
+    report(s.result('unix pingpong', size, 1))
+  })
+
+  if (lib.shmconnect) {
+    const a = lib.shmconnect(cs, 1 << 20)
+    const b = lib.shmaccept(as)
+    sizes.forEach(function (size) {
+      const msg = new Buffer(size).fill('x')
+      const s = new Sampler(n)
+      for (var i = 0; i < n; i++) {
+        const t0 = s.time()
+        lib.shmsend(a, msg)
+        lib.shmflush(a)
+        lib.shmrecv(b, size)
+        lib.shmsend(b, msg)
+        lib.shmflush(b)
+        lib.shmrecv(a, size)
+        s.done(t0, 2 * size)
+      }
+      report(s.result('shm pingpong', size, 1))
+    })
+    lib.shmclose(a)
+    lib.shmclose(b)
+  }
+
+  lib.unixclose(cs)
+  lib.unixclose(as)
+  lib.unixclose(ls)
+}
@@ -26,8 +26,22 @@
 #include "nan.h"
 
 #include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,11 +52,16 @@ extern "C" {
 }
 
 using v8::FunctionTemplate;
+using v8::Uint32Array;
+using v8::Float64Array;
+using v8::ArrayBuffer;
+using v8::Isolate;
 using v8::Function;
 using v8::Number;
 using v8::Boolean;
 using v8::String;
 using v8::Object;
+using v8::Array;
 using v8::Value;
 using v8::Local;
 
@@ -60,9 +79,22 @@ using Nan::To;
 #define ret info.GetReturnValue().Set
 #define utf8 String::Utf8Value
 
+/* libmill keeps one scheduler per process. While threadlisten() runs it on
+   its own thread, a call from JS that enters libmill would run it on two
+   threads at once, so those calls throw instead. The async (callback) calls
+   and the buffer, address and stats helpers stay out of libmill. */
+static int thread_running;
+
+#define MILL_GUARD(name)                                                       \
+  if (thread_running)                                                          \
+    return Nan::ThrowError(name ": libmill belongs to the scheduler thread, "  \
+      "only async calls until threadstop()")
+
 #include "ref.h"
 #include "timer.c"
 #include "cb.h"
+#include "pool.h"
+#include "wheel.h"
 
 
 /******************************************************************************/
@@ -111,6 +143,7 @@ NAN_METHOD(iplocal){
 }
 
 NAN_METHOD(ipremote){
+  MILL_GUARD("ipremote");
   /* port */
   int port = To<int>(info[1]).FromJust();
 
@@ -133,6 +166,51 @@ NAN_METHOD(ipremote){
   ret(addr);
 }
 
+/* stringify a raw ipaddr, e.g. an entry of a batched udprecv addrs table */
+NAN_METHOD(ipaddrstr){
+  size_t i = 0;
+  if (info[1]->IsNumber())
+    i = To<uint32_t>(info[1]).FromJust();
+
+  if ((i + 1) * sizeof(ipaddr) > node::Buffer::Length(info[0]))
+    return Nan::ThrowRangeError("ipaddr index out of range");
+
+  ipaddr *addr = UnwrapPointer<ipaddr*>(info[0]) + i;
+  ipaddrstr(*addr, ipstr);
+  ret(New<String>(ipstr).ToLocalChecked());
+}
+
+/* Resolves the (target, offset, len) triple of the *recvinto calls to the
+   destination within target. len defaults to the rest of the buffer. Returns
+   NULL and throws when the range does not fit in target. */
+static char *recvinto(Local<Value> target, Local<Value> offset,
+  Local<Value> length, size_t *len) {
+  if (!node::Buffer::HasInstance(target)) {
+    Nan::ThrowTypeError("recvinto target must be a Buffer");
+    return NULL;
+  }
+
+  size_t tlen = node::Buffer::Length(target);
+  size_t off = 0;
+  if (offset->IsNumber())
+    off = To<uint32_t>(offset).FromJust();
+  if (off > tlen) {
+    Nan::ThrowRangeError("recvinto offset out of range");
+    return NULL;
+  }
+
+  *len = tlen - off;
+  if (length->IsNumber()) {
+    size_t l = To<uint32_t>(length).FromJust();
+    if (l > *len) {
+      Nan::ThrowRangeError("recvinto length out of range");
+      return NULL;
+    }
+    *len = l;
+  }
+  return node::Buffer::Data(target) + off;
+}
+
 /******************************************************************************/
 /*  TCP library                                                               */
 /******************************************************************************/
@@ -172,10 +250,46 @@ struct mill_tcpconn {
   ipaddr addr;
 };
 
+struct mill_udpsock {
+  int fd;
+  int port;
+};
+
 typedef struct tcp_s {
   uv_poll_t poll_handle;
   uv_os_sock_t fd;
   Callback *cb;
+
+  /* async connection state, see tcpctx() */
+  void *sock;
+  size_t *ifirst;
+  size_t *ilen;
+  size_t *olen;
+  char *ibuf;
+  char *obuf;
+  size_t buflen;
+  double *stat;
+
+  /* pending recv, completes once rlen bytes (or a delimiter) arrived */
+  Callback *rcb;
+  char *rbuf;
+  size_t rlen;
+  size_t rsz;
+  struct delims *until;
+
+  /* pending send or flush */
+  Callback *scb;
+  char *sbuf;
+  size_t slen;
+  size_t ssz;
+  int flush;
+
+  /* timeouts in ms, 0 for none, see tcptimeouts() */
+  struct idle idle;
+  uint32_t rtimeout;
+  uint32_t wtimeout;
+  struct wtimer tread;
+  struct wtimer twrite;
 } tcp_t;
 
 static void tcptune(int s) {
@@ -206,6 +320,80 @@ static void tcpconn_init(struct mill_tcpconn *conn, int fd) {
   conn->olen = 0;
 }
 
+/* Per-socket options set with tcpopts(), on a connection or on a listener
+   whose connections inherit them. libmill's ibuf/obuf are fixed in its
+   connection struct; what can be tuned is whether calls go through them at
+   all. Entries are indexed by fd and checked against the owning socket. */
+struct tcpopt {
+  void *sock;
+  int unbuffered;
+  struct boxctx *box; /* see tcpbox() */
+};
+
+/* crypto contexts are refcounted by the connections they are bound to */
+static void box_retain(struct boxctx *ctx);
+static void box_release(struct boxctx *ctx);
+
+static struct tcpopt *tcpopt_tab;
+static size_t tcpopt_len;
+
+/* listeners and connections both keep the fd right after the type */
+static int tcpfd(tcpsock s) {
+  if (s->type == MILL_TCPLISTENER)
+    return ((struct mill_tcplistener *)s)->fd;
+  return ((struct mill_tcpconn *)s)->fd;
+}
+
+static struct tcpopt *tcpopt(tcpsock s, int create) {
+  size_t fd = tcpfd(s);
+  if (fd < tcpopt_len && tcpopt_tab[fd].sock == s)
+    return &tcpopt_tab[fd];
+  if (!create)
+    return NULL;
+
+  if (fd >= tcpopt_len) {
+    size_t len = fd * 2 + 64;
+    tcpopt_tab = (struct tcpopt *)realloc(tcpopt_tab,
+      len * sizeof(struct tcpopt));
+    assert(tcpopt_tab);
+    memset(tcpopt_tab + tcpopt_len, 0,
+      (len - tcpopt_len) * sizeof(struct tcpopt));
+    tcpopt_len = len;
+  }
+  memset(&tcpopt_tab[fd], 0, sizeof(struct tcpopt));
+  tcpopt_tab[fd].sock = s;
+  return &tcpopt_tab[fd];
+}
+
+static int tcpunbuffered(tcpsock s) {
+  struct tcpopt *o = tcpopt(s, 0);
+  return o && o->unbuffered;
+}
+
+/* a new connection takes over its listener's options */
+static void tcpopt_inherit(tcpsock ls, tcpsock as) {
+  struct tcpopt *o = tcpopt(ls, 0);
+  if (o) {
+    struct tcpopt *n = tcpopt(as, 1);
+    *n = *o;
+    n->sock = as;
+    box_retain(n->box);
+  }
+}
+
+static void tcpopt_close(tcpsock s) {
+  struct tcpopt *o = tcpopt(s, 0);
+  if (o) {
+    box_release(o->box);
+    o->box = NULL;
+    o->sock = NULL;
+  }
+}
+
+#include "iostat.h"
+#include "hist.h"
+#include "stream.h"
+
 void tcpAccept(uv_poll_t *req, int status, int events) {
   HandleScope scope;
   if (events & UV_READABLE) {
@@ -214,6 +402,7 @@ void tcpAccept(uv_poll_t *req, int status, int events) {
 
     tcp_t *ctx;
     ctx = reinterpret_cast<tcp_t *>(req);
+    idle_touch(&ctx->idle);
 
     int as = accept(ctx->fd, (struct sockaddr *)&addr, &slen);
     tcptune(as);
@@ -224,20 +413,490 @@ void tcpAccept(uv_poll_t *req, int status, int events) {
     assert(conn);
     conn->addr = addr;
 
+    tcpopt_inherit((tcpsock)ctx->sock, (tcpsock)conn);
+
     Local<Value> argv[] = { WrapPointer((tcpsock)conn, sizeof(mill_tcpconn)) };
     ctx->cb->Call(1, argv);
   }
 }
 
+/* Async connections get one poll context per fd, no matter how many calls are
+   made on them. Contexts are looked up by fd and checked against the owning
+   socket so a recycled fd never inherits a stale context. Unix connections
+   share the same machinery through their stream view. */
+static tcp_t **tcpctxs;
+static size_t tcpctxs_len;
+
+static void tcpIO(uv_poll_t *req, int status, int events);
+
+static tcp_t *streamctx(void *s, struct stream *st) {
+  int fd = st->fd;
+
+  if ((size_t)fd >= tcpctxs_len) {
+    size_t len = fd * 2 + 64;
+    tcpctxs = (tcp_t **)realloc(tcpctxs, len * sizeof(tcp_t *));
+    assert(tcpctxs);
+    memset(tcpctxs + tcpctxs_len, 0, (len - tcpctxs_len) * sizeof(tcp_t *));
+    tcpctxs_len = len;
+  }
+
+  tcp_t *ctx = tcpctxs[fd];
+  if (ctx && ctx->sock == s)
+    return ctx;
+  assert(!ctx);
+
+  ctx = reinterpret_cast<tcp_t *>(calloc(1, sizeof(tcp_t)));
+  assert(ctx);
+  ctx->poll_handle.data = ctx;
+  ctx->fd = fd;
+  ctx->sock = s;
+  ctx->ifirst = st->ifirst;
+  ctx->ilen = st->ilen;
+  ctx->olen = st->olen;
+  ctx->ibuf = st->ibuf;
+  ctx->obuf = st->obuf;
+  ctx->buflen = st->buflen;
+  ctx->stat = st->stat;
+  uv_poll_init_socket(uv_default_loop(), &ctx->poll_handle, fd);
+
+  tcpctxs[fd] = ctx;
+  return ctx;
+}
+
+static tcp_t *tcpctx(tcpsock s) {
+  if (s->type != MILL_TCPCONN)
+    abort(); // abort trap! async recv/send on a listening sock..
+  struct stream st;
+  stream_tcp(s, &st);
+  return streamctx(s, &st);
+}
+
+/* poll only for what the pending operations need, an idle connection keeps
+   no events registered and does not hold the loop open */
+static void tcpctx_update(tcp_t *ctx) {
+  int events = 0;
+  if (ctx->rcb)
+    events |= UV_READABLE;
+  if (ctx->scb)
+    events |= UV_WRITABLE;
+
+  if (events)
+    uv_poll_start(&ctx->poll_handle, events, tcpIO);
+  else
+    uv_poll_stop(&ctx->poll_handle);
+}
+
+static void tcpctx_free(uv_handle_t *handle) {
+  tcp_t *ctx = (tcp_t *)handle->data;
+  idle_free(&ctx->idle);
+  free(ctx);
+}
+
+static void streamctx_close(void *s, int fd) {
+  if ((size_t)fd >= tcpctxs_len || !tcpctxs[fd] || tcpctxs[fd]->sock != s)
+    return;
+
+  tcp_t *ctx = tcpctxs[fd];
+  tcpctxs[fd] = NULL;
+
+  /* pending callbacks are dropped along with the connection */
+  delete ctx->rcb;
+  delete ctx->scb;
+  pool_discard(ctx->rbuf);
+  free(ctx->until);
+  free(ctx->sbuf);
+  ctx->rcb = ctx->scb = NULL;
+  ctx->sock = NULL;
+  wheel_cancel(&ctx->tread);
+  wheel_cancel(&ctx->twrite);
+  wheel_cancel(&ctx->idle.timer);
+
+  /* stops polling before libmill closes the fd, frees on the next tick */
+  uv_close((uv_handle_t *)&ctx->poll_handle, tcpctx_free);
+}
+
+static void tcpctx_close(tcpsock s) {
+  if (s->type == MILL_TCPCONN)
+    streamctx_close(s, ((struct mill_tcpconn*)s)->fd);
+}
+
+/* Moves bytes towards the pending recv, first out of the connection's input
+   buffer, then from the kernel. Returns 0 while the recv would block,
+   otherwise 1 with errno set the way libmill's tcprecv/tcprecvuntil would. */
+static int tcprecv_step(tcp_t *ctx) {
+  for (;;) {
+    /* serve from the input buffer first */
+    while (*ctx->ilen > 0 && ctx->rsz < ctx->rlen) {
+      size_t n = *ctx->ilen;
+      if (n > ctx->rlen - ctx->rsz)
+        n = ctx->rlen - ctx->rsz;
+      memcpy(ctx->rbuf + ctx->rsz, ctx->ibuf + *ctx->ifirst, n);
+
+      size_t dlen;
+      ssize_t at = -1;
+      if (ctx->until)
+        at = delims_find(ctx->until, ctx->rbuf,
+          delims_from(ctx->until, ctx->rsz), ctx->rsz + n, &dlen);
+      if (at >= 0)
+        n = at + dlen - ctx->rsz;
+
+      ctx->rsz += n;
+      *ctx->ifirst += n;
+      *ctx->ilen -= n;
+      if (at >= 0) {
+        errno = 0;
+        return 1;
+      }
+    }
+
+    if (ctx->rsz == ctx->rlen) {
+      errno = ctx->until ? ENOBUFS : 0;
+      return 1;
+    }
+
+    /* large reads go straight to the destination, small ones via ibuf
+       unless the connection is unbuffered */
+    ssize_t sz;
+    size_t remaining = ctx->rlen - ctx->rsz;
+    if (!ctx->until && (remaining >= ctx->buflen ||
+        tcpunbuffered((tcpsock)ctx->sock))) {
+      sz = recv(ctx->fd, ctx->rbuf + ctx->rsz, remaining, 0);
+      iostat_syscall(ctx->stat, sz);
+      if (sz > 0)
+        ctx->rsz += sz;
+    } else {
+      sz = recv(ctx->fd, ctx->ibuf, ctx->buflen, 0);
+      iostat_syscall(ctx->stat, sz);
+      *ctx->ifirst = 0;
+      *ctx->ilen = sz > 0 ? sz : 0;
+    }
+
+    if (sz == 0) {
+      errno = ECONNRESET;
+      return 1;
+    }
+    if (sz < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return 1;
+    }
+  }
+}
+
+/* Same buffering as libmill's tcpsend: the payload is copied to obuf when it
+   fits. When it does not, obuf and the payload go out together in a single
+   gather write, and only the tail that fits is left buffered. A flush drains
+   obuf completely. Returns 0 while the write would block. */
+static int tcpsend_step(tcp_t *ctx) {
+  for (;;) {
+    size_t remaining = ctx->slen - ctx->ssz;
+    if (!ctx->flush && remaining <= ctx->buflen - *ctx->olen &&
+        !tcpunbuffered((tcpsock)ctx->sock)) {
+      memcpy(ctx->obuf + *ctx->olen, ctx->sbuf + ctx->ssz, remaining);
+      *ctx->olen += remaining;
+      ctx->ssz = ctx->slen;
+      errno = 0;
+      return 1;
+    }
+    if ((ctx->flush || !remaining) && *ctx->olen == 0) {
+      errno = 0;
+      return 1;
+    }
+
+    struct iovec iov[2];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    iov[hdr.msg_iovlen].iov_base = ctx->obuf;
+    iov[hdr.msg_iovlen++].iov_len = *ctx->olen;
+    if (remaining) {
+      iov[hdr.msg_iovlen].iov_base = ctx->sbuf + ctx->ssz;
+      iov[hdr.msg_iovlen++].iov_len = remaining;
+    }
+
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    ssize_t sz = sendmsg(ctx->fd, &hdr, flags);
+    iostat_syscall(ctx->stat, sz);
+    if (sz < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return 1;
+    }
+
+    /* consume obuf first, then the payload */
+    size_t n = (size_t)sz < *ctx->olen ? sz : *ctx->olen;
+    memmove(ctx->obuf, ctx->obuf + n, *ctx->olen - n);
+    *ctx->olen -= n;
+    ctx->ssz += sz - n;
+  }
+}
+
+/* async callbacks follow libmill's convention of returning what was done
+   and reporting the failure through errno: cb(result, errno) */
+static void tcprecv_done(tcp_t *ctx) {
+  Callback *cb = ctx->rcb;
+  int err = errno;
+  wheel_cancel(&ctx->tread);
+  idle_touch(&ctx->idle);
+  iostat_recv(ctx->stat, ctx->rsz, err != 0);
+  Local<Value> argv[] = {
+    pool_buffer(ctx->rbuf, ctx->rsz),
+    New<Number>(err)
+  };
+  ctx->rcb = NULL;
+  ctx->rbuf = NULL;
+  free(ctx->until);
+  ctx->until = NULL;
+  cb->Call(2, argv);
+  delete cb;
+}
+
+static void tcpsend_done(tcp_t *ctx) {
+  Callback *cb = ctx->scb;
+  int err = errno;
+  size_t sz = ctx->ssz;
+  int flush = ctx->flush;
+  wheel_cancel(&ctx->twrite);
+  idle_touch(&ctx->idle);
+  if (flush)
+    iostat_add(ctx->stat, IOSTAT_FLUSHES, 1);
+  else
+    iostat_send(ctx->stat, sz);
+  free(ctx->sbuf);
+  ctx->scb = NULL;
+  ctx->sbuf = NULL;
+
+  if (flush) {
+    Local<Value> argv[] = { New<Number>(err) };
+    cb->Call(1, argv);
+  } else {
+    Local<Value> argv[] = { New<Number>(sz), New<Number>(err) };
+    cb->Call(2, argv);
+  }
+  delete cb;
+}
+
+static void tcpIO(uv_poll_t *req, int status, int events) {
+  HandleScope scope;
+  tcp_t *ctx = reinterpret_cast<tcp_t *>(req);
+
+  /* a poll error fails whatever is pending */
+  if (status < 0) {
+    if (ctx->rcb) {
+      errno = -status;
+      tcprecv_done(ctx);
+    }
+    if (ctx->sock && ctx->scb) {
+      errno = -status;
+      tcpsend_done(ctx);
+    }
+  } else {
+    idle_touch(&ctx->idle);
+    if ((events & UV_READABLE) && ctx->rcb && tcprecv_step(ctx))
+      tcprecv_done(ctx);
+    if ((events & UV_WRITABLE) && ctx->sock && ctx->scb && tcpsend_step(ctx))
+      tcpsend_done(ctx);
+  }
+
+  /* a callback may have closed the connection */
+  if (ctx->sock)
+    tcpctx_update(ctx);
+}
+
+/* a read or write timeout completes the pending op with ETIMEDOUT, the way
+   a blocking call returns what it got by its deadline */
+static void tcpctx_timedout(struct wtimer *w) {
+  tcp_t *ctx = (tcp_t *)w->data;
+  errno = ETIMEDOUT;
+  if (w == &ctx->tread && ctx->rcb)
+    tcprecv_done(ctx);
+  else if (w == &ctx->twrite && ctx->scb)
+    tcpsend_done(ctx);
+  if (ctx->sock)
+    tcpctx_update(ctx);
+}
+
+static uint32_t timeout_ms(Local<Value> v) {
+  return v->IsNumber() ? To<uint32_t>(v).FromJust() : 0;
+}
+
+/* new read and write timeouts apply from the next recv or send on */
+static void tcpctx_timeouts(tcp_t *ctx, Local<Value> idle, Local<Value> read,
+  Local<Value> write, Local<Value> onidle) {
+  ctx->rtimeout = timeout_ms(read);
+  ctx->wtimeout = timeout_ms(write);
+  ctx->tread.fire = ctx->twrite.fire = tcpctx_timedout;
+  ctx->tread.data = ctx->twrite.data = ctx;
+  idle_set(&ctx->idle, timeout_ms(idle), onidle);
+}
+
+/* Starts an async recv, completes right away when enough is buffered.
+   until is a delimiter set for a recvuntil, NULL for a plain recv. */
+static void tcprecv_async(tcp_t *ctx, size_t len, const struct delims *until,
+  Callback *cb) {
+  if (ctx->rcb) {
+    Local<Value> argv[] = { NewBuffer(0).ToLocalChecked(), New<Number>(EBUSY) };
+    cb->Call(2, argv);
+    delete cb;
+    return;
+  }
+
+  ctx->rcb = cb;
+  ctx->rbuf = pool_alloc(len);
+  ctx->rlen = len;
+  ctx->rsz = 0;
+  if (until) {
+    ctx->until = (struct delims *)malloc(sizeof(struct delims));
+    assert(ctx->until);
+    *ctx->until = *until;
+  }
+
+  if (tcprecv_step(ctx))
+    tcprecv_done(ctx);
+  else if (ctx->rtimeout)
+    wheel_add(&ctx->tread, ctx->rtimeout);
+  if (ctx->sock)
+    tcpctx_update(ctx);
+}
+
+/* starts an async send (data != NULL) or flush */
+static void tcpsend_async(tcp_t *ctx, const char *data, size_t len,
+  Callback *cb) {
+  if (ctx->scb) {
+    if (data) {
+      Local<Value> argv[] = { New<Number>(0), New<Number>(EBUSY) };
+      cb->Call(2, argv);
+    } else {
+      Local<Value> argv[] = { New<Number>(EBUSY) };
+      cb->Call(1, argv);
+    }
+    delete cb;
+    return;
+  }
+
+  ctx->scb = cb;
+  ctx->flush = !data;
+  ctx->slen = len;
+  ctx->ssz = 0;
+
+  /* common case: the payload fits in obuf, nothing to hold on to */
+  if (data && len <= ctx->buflen - *ctx->olen &&
+      !tcpunbuffered((tcpsock)ctx->sock)) {
+    memcpy(ctx->obuf + *ctx->olen, data, len);
+    *ctx->olen += len;
+    ctx->ssz = len;
+    errno = 0;
+    tcpsend_done(ctx);
+    return;
+  }
+
+  /* the JS buffer may change before the socket is writable */
+  if (data) {
+    ctx->sbuf = (char *)malloc(len);
+    assert(ctx->sbuf);
+    memcpy(ctx->sbuf, data, len);
+  }
+
+  if (tcpsend_step(ctx))
+    tcpsend_done(ctx);
+  else if (ctx->wtimeout)
+    wheel_add(&ctx->twrite, ctx->wtimeout);
+  if (ctx->sock)
+    tcpctx_update(ctx);
+}
+
+/* Same as libmill's tcplisten, with the socket options that have to be set
+   before bind(). With reuseport, every worker (thread or process) opens its
+   own listener on the same address and the kernel spreads incoming
+   connections across them. cpu >= 0 pins the listener to the connections
+   arriving on that cpu's receive queue. */
+static tcpsock tcplisten_shard(ipaddr addr, int backlog, int reuseport,
+  int cpu) {
+  struct sockaddr *sa = (struct sockaddr *)&addr;
+  socklen_t slen = sa->sa_family == AF_INET ?
+    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+  int s = socket(sa->sa_family, SOCK_STREAM, 0);
+  if (s == -1)
+    return NULL;
+  tcptune(s);
+
+  int opt = 1;
+  if (reuseport) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt)) == -1)
+      goto fail;
+#else
+    errno = ENOPROTOOPT;
+    goto fail;
+#endif
+  }
+  if (cpu >= 0) {
+#ifdef SO_INCOMING_CPU
+    if (setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof (cpu)) == -1)
+      goto fail;
+#else
+    errno = ENOPROTOOPT;
+    goto fail;
+#endif
+  }
+
+  if (bind(s, sa, slen) == -1 || listen(s, backlog) == -1)
+    goto fail;
+
+  /* with port 0 the kernel picked one */
+  struct sockaddr_storage bound;
+  slen = sizeof(bound);
+  if (getsockname(s, (struct sockaddr *)&bound, &slen) == -1)
+    goto fail;
+
+  struct mill_tcplistener *l;
+  l = (struct mill_tcplistener *)malloc(sizeof(struct mill_tcplistener));
+  if (!l) {
+    errno = ENOMEM;
+    goto fail;
+  }
+  l->sock.type = MILL_TCPLISTENER;
+  l->fd = s;
+  l->port = ntohs(bound.ss_family == AF_INET ?
+    ((struct sockaddr_in *)&bound)->sin_port :
+    ((struct sockaddr_in6 *)&bound)->sin6_port);
+  return &l->sock;
+
+fail:
+  int err = errno;
+  close(s);
+  errno = err;
+  return NULL;
+}
+
+//api: tcplisten(ipaddr, backlog, { reuseport: bool, cpu: n })
 NAN_METHOD(tcplisten){
+  MILL_GUARD("tcplisten");
   /* backlog settings */
   int backlog = 10;
   if (info[1]->IsNumber())
     backlog = To<int>(info[1]).FromJust();
 
   /* dereference and pass ipaddr buffer to tcplisten */
-  tcpsock ls = tcplisten(*UnwrapPointer<ipaddr*>(info[0]), backlog);
-  assert(ls);
+  tcpsock ls;
+  if (info[2]->IsObject()) {
+    Local<Object> opts = info[2].As<Object>();
+    Local<Value> rp = Nan::Get(opts, New("reuseport").ToLocalChecked())
+      .ToLocalChecked();
+    Local<Value> cpu = Nan::Get(opts, New("cpu").ToLocalChecked())
+      .ToLocalChecked();
+
+    ls = tcplisten_shard(*UnwrapPointer<ipaddr*>(info[0]), backlog,
+      To<bool>(rp).FromJust(), cpu->IsNumber() ? To<int>(cpu).FromJust() : -1);
+  } else {
+    ls = tcplisten(*UnwrapPointer<ipaddr*>(info[0]), backlog);
+  }
+  if (!ls)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcplisten"));
   ret(WrapPointer(ls, sizeof(tcpsock)));
 }
 
@@ -267,19 +926,47 @@ NAN_METHOD(tcpaccept){
     ctx->poll_handle.data = ctx;
     ctx->cb = cb;
     ctx->fd = l->fd;
+    ctx->sock = s;
 
     uv_poll_init_socket(uv_default_loop(), &ctx->poll_handle, ctx->fd);
     uv_poll_start(&ctx->poll_handle, UV_READABLE, tcpAccept);
 
     ret(WrapPointer(ctx, sizeof(tcp_t)));
   } else {
+    MILL_GUARD("tcpaccept");
+    uint64_t t0 = hist_start();
     tcpsock as = tcpaccept(s, deadline);
+    hist_record(HIST_TCPACCEPT, t0);
     assert(as);
+    tcpopt_inherit(s, as);
     ret(WrapPointer(as, sizeof(&as)));
   }
 }
 
+static void accept_free(uv_handle_t *handle) {
+  tcp_t *ctx = reinterpret_cast<tcp_t *>(handle);
+  idle_free(&ctx->idle);
+  delete ctx->cb;
+  free(ctx);
+}
+
+/* stop an async tcpaccept, pass the handle it returned */
+NAN_METHOD(tcpacceptstop){
+  tcp_t *ctx = UnwrapPointer<tcp_t *>(info[0]);
+  wheel_cancel(&ctx->idle.timer);
+  uv_close((uv_handle_t *)&ctx->poll_handle, accept_free);
+}
+
+/* onidle() after ms without a new connection, works on unixaccept handles
+   too. ms 0 turns it off */
+//api: acceptidle(h, ms, onidle)
+NAN_METHOD(acceptidle){
+  tcp_t *ctx = UnwrapPointer<tcp_t *>(info[0]);
+  idle_set(&ctx->idle, timeout_ms(info[1]), info[2]);
+}
+
 NAN_METHOD(tcpconnect){
+  MILL_GUARD("tcpconnect");
   /* deadline */
   int64_t deadline = -1;
   if (info[1]->IsNumber())
@@ -292,29 +979,101 @@ NAN_METHOD(tcpconnect){
 }
 
 NAN_METHOD(tcpsend){
+  if (info[2]->IsFunction()) {
+    tcpsend_async(tcpctx(UnwrapPointer<tcpsock>(info[0])),
+                  node::Buffer::Data(info[1]),
+                  node::Buffer::Length(info[1]),
+                  new Callback(info[2].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("tcpsend");
+
   /* deadline */
   int64_t deadline = -1;
   if (info[2]->IsNumber())
     deadline = now() + To<int64_t>(info[2]).FromJust();
 
-  size_t sz = tcpsend(UnwrapPointer<tcpsock>(info[0]),
-                      node::Buffer::Data(info[1]),
-                      node::Buffer::Length(info[1]),
-                      deadline);
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  if (!node::Buffer::HasInstance(info[1]))
+    return Nan::ThrowTypeError("tcpsend takes a Buffer");
+  if (tcpunbuffered(s)) {
+    struct stream st;
+    stream_tcp(s, &st);
+    size_t sz = stream_sendbufs(&st, info[1], deadline);
+    iostat_send(st.stat, sz);
+    return ret(New<Number>(sz));
+  }
 
+  /* what a timed out tcpsplice left for s goes ahead of libmill's obuf */
+  struct stream st;
+  stream_tcp(s, &st);
+  if (stream_pipe_flush(&st, deadline))
+    return ret(New<Number>(0));
+
+  size_t sz = tcpsend(s, node::Buffer::Data(info[1]),
+                      node::Buffer::Length(info[1]), deadline);
+  iostat_send(iostat(s, tcpfd(s)), sz);
+
+  ret(New<Number>(sz));
+}
+
+/* Gathers the buffers into one write instead of copying each through obuf,
+   only payloads that fit in obuf are buffered until the next flush. */
+//api: tcpsendv(s, [bufs], deadline)
+NAN_METHOD(tcpsendv){
+  MILL_GUARD("tcpsendv");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  if (!stream_checkbufs(info[1]))
+    return;
+
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  size_t sz = stream_sendbufs(&st, info[1], deadline);
+  if (errno)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcpsendv"));
+  iostat_send(st.stat, sz);
   ret(New<Number>(sz));
 }
 
 NAN_METHOD(tcpflush){
+  if (info[1]->IsFunction()) {
+    tcpsend_async(tcpctx(UnwrapPointer<tcpsock>(info[0])), NULL, 0,
+                  new Callback(info[1].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("tcpflush");
+
   /* deadline */
   int64_t deadline = -1;
   if (info[1]->IsNumber())
     deadline = now() + To<int64_t>(info[1]).FromJust();
 
-  tcpflush(UnwrapPointer<tcpsock>(info[0]), deadline);
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  struct stream st;
+  stream_tcp(s, &st);
+  uint64_t t0 = hist_start();
+  if (!stream_pipe_flush(&st, deadline))
+    tcpflush(s, deadline);
+  hist_record(HIST_TCPFLUSH, t0);
+  iostat_add(iostat(s, tcpfd(s)), IOSTAT_FLUSHES, 1);
 }
 
 NAN_METHOD(tcprecv){
+  if (info[2]->IsFunction()) {
+    tcprecv_async(tcpctx(UnwrapPointer<tcpsock>(info[0])),
+                  To<int>(info[1]).FromJust(), NULL,
+                  new Callback(info[2].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("tcprecv");
+
   /* deadline */
   int64_t deadline = -1;
   if (info[2]->IsNumber())
@@ -322,17 +1081,39 @@ NAN_METHOD(tcprecv){
 
   int rcvbuf = To<int>(info[1]).FromJust();
 
-  char buf[rcvbuf];
-  size_t sz = tcprecv(UnwrapPointer<tcpsock>(info[0]), buf, rcvbuf, deadline);
-
-  v8::Local<v8::Object> rc = NewBuffer(sz).ToLocalChecked();
-  memcpy(node::Buffer::Data(rc), buf, sz);
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  char *buf = pool_alloc(rcvbuf);
+  size_t sz;
+  uint64_t t0 = hist_start();
+  if (tcpunbuffered(s)) {
+    struct stream st;
+    stream_tcp(s, &st);
+    sz = stream_read(&st, buf, rcvbuf, deadline);
+  } else {
+    sz = tcprecv(s, buf, rcvbuf, deadline);
+  }
+  hist_record(HIST_TCPRECV, t0);
+  iostat_recv(iostat(s, tcpfd(s)), sz, sz < (size_t)rcvbuf);
 
-  ret(rc);
+  ret(pool_buffer(buf, sz));
 }
 
-//TODO: delimiters: const char *delims, size_t delimcount
+//api: tcprecvuntil(s, len, deadline | cb, delims), delims default to '\r'
 NAN_METHOD(tcprecvuntil){
+  /* recvuntil delimiters */
+  struct delims until;
+  if (delims_parse(info[3], &until))
+    return;
+
+  if (info[2]->IsFunction()) {
+    tcprecv_async(tcpctx(UnwrapPointer<tcpsock>(info[0])),
+                  To<int>(info[1]).FromJust(), &until,
+                  new Callback(info[2].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("tcprecvuntil");
+
   /* deadline */
   int64_t deadline = -1;
   if (info[2]->IsNumber())
@@ -340,36 +1121,246 @@ NAN_METHOD(tcprecvuntil){
 
   /* recv buffer size */
   int rcvbuf = To<int>(info[1]).FromJust();
-  char buf[rcvbuf];
+  char *buf = pool_alloc(rcvbuf);
 
-  /* recvuntil delimiters */
-  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
-  size_t sz = tcprecvuntil(s, buf, sizeof(buf), "\r", 1, deadline);
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  uint64_t t0 = hist_start();
+  size_t sz = stream_recvuntil(&st, buf, rcvbuf, &until, deadline);
+  iostat_recv(st.stat, sz, errno != 0);
+  hist_record(HIST_TCPRECV, t0);
 
   /* fill recv buffer from OS */
-  Local<Value> rc = NewBuffer(sz).ToLocalChecked();
-  memcpy(node::Buffer::Data(rc), buf, sz);
+  ret(pool_buffer(buf, sz));
+}
 
-  ret(rc);
+//api: tcprecvinto(s, target, offset, len, deadline)
+NAN_METHOD(tcprecvinto){
+  MILL_GUARD("tcprecvinto");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[4]->IsNumber())
+    deadline = now() + To<int64_t>(info[4]).FromJust();
+
+  size_t len;
+  char *dst = recvinto(info[1], info[2], info[3], &len);
+  if (!dst)
+    return;
+
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  size_t sz;
+  uint64_t t0 = hist_start();
+  if (tcpunbuffered(s)) {
+    struct stream st;
+    stream_tcp(s, &st);
+    sz = stream_read(&st, dst, len, deadline);
+  } else {
+    sz = tcprecv(s, dst, len, deadline);
+  }
+  hist_record(HIST_TCPRECV, t0);
+  iostat_recv(iostat(s, tcpfd(s)), sz, sz < len);
+  ret(New<Number>(sz));
+}
+
+//api: tcprecvuntilinto(s, target, offset, len, deadline, delims)
+NAN_METHOD(tcprecvuntilinto){
+  MILL_GUARD("tcprecvuntilinto");
+  struct delims until;
+  if (delims_parse(info[5], &until))
+    return;
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[4]->IsNumber())
+    deadline = now() + To<int64_t>(info[4]).FromJust();
+
+  size_t len;
+  char *dst = recvinto(info[1], info[2], info[3], &len);
+  if (!dst)
+    return;
+
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  uint64_t t0 = hist_start();
+  size_t sz = stream_recvuntil(&st, dst, len, &until, deadline);
+  iostat_recv(st.stat, sz, errno != 0);
+  hist_record(HIST_TCPRECV, t0);
+  ret(New<Number>(sz));
+}
+
+/* Options take effect on the next call. With buffered: false, sends skip
+   obuf and go straight to the kernel, and recvs read no more than asked for,
+   which matters when many small connections each sit on a full ibuf. Kernel
+   buffer sizes set on a listener carry over to its connections. Returns the
+   sizes in effect, which the kernel may have adjusted. */
+//api: tcpopts(s, { rcvbuf: n, sndbuf: n, buffered: bool })
+NAN_METHOD(tcpopts){
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  int fd = tcpfd(s);
+
+  if (info[1]->IsObject()) {
+    Local<Object> opts = info[1].As<Object>();
+    Local<Value> rcvbuf = Nan::Get(opts, New("rcvbuf").ToLocalChecked())
+      .ToLocalChecked();
+    Local<Value> sndbuf = Nan::Get(opts, New("sndbuf").ToLocalChecked())
+      .ToLocalChecked();
+    Local<Value> buffered = Nan::Get(opts, New("buffered").ToLocalChecked())
+      .ToLocalChecked();
+
+    int opt;
+    if (rcvbuf->IsNumber()) {
+      opt = To<int>(rcvbuf).FromJust();
+      if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof (opt)) == -1)
+        return Nan::ThrowError(Nan::ErrnoException(errno, "tcpopts"));
+    }
+    if (sndbuf->IsNumber()) {
+      opt = To<int>(sndbuf).FromJust();
+      if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof (opt)) == -1)
+        return Nan::ThrowError(Nan::ErrnoException(errno, "tcpopts"));
+    }
+    if (buffered->IsBoolean())
+      tcpopt(s, 1)->unbuffered = !To<bool>(buffered).FromJust();
+  }
+
+  int rcv = 0, snd = 0;
+  socklen_t olen = sizeof (rcv);
+  getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv, &olen);
+  olen = sizeof (snd);
+  getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &snd, &olen);
+
+  Local<Object> o = New<Object>();
+  Set(o, New("rcvbuf").ToLocalChecked(), New<Number>(rcv));
+  Set(o, New("sndbuf").ToLocalChecked(), New<Number>(snd));
+  Set(o, New("buffered").ToLocalChecked(), New<Boolean>(!tcpunbuffered(s)));
+  ret(o);
 }
 
+//api: tcpsendfile(s, fd, offset, len, deadline), len defaults to the rest
+NAN_METHOD(tcpsendfile){
+  MILL_GUARD("tcpsendfile");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[4]->IsNumber())
+    deadline = now() + To<int64_t>(info[4]).FromJust();
+
+  int fd = To<int>(info[1]).FromJust();
+  off_t off = 0;
+  if (info[2]->IsNumber())
+    off = To<int64_t>(info[2]).FromJust();
+  if (off < 0)
+    return Nan::ThrowRangeError("tcpsendfile offset must not be negative");
+
+  size_t len;
+  if (info[3]->IsNumber()) {
+    int64_t n = To<int64_t>(info[3]).FromJust();
+    if (n < 0)
+      return Nan::ThrowRangeError("tcpsendfile len must not be negative");
+    len = n;
+  } else {
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+      return Nan::ThrowError(Nan::ErrnoException(errno, "tcpsendfile"));
+    len = st.st_size > off ? st.st_size - off : 0;
+  }
+
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  ssize_t sz = stream_sendfile(&st, fd, off, len, deadline);
+  if (sz < 0)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcpsendfile"));
+  iostat_send(st.stat, sz);
+  ret(New<Number>(sz));
+}
+
+//api: tcpsplice(src, dst, len, deadline), len defaults to until src ends
+NAN_METHOD(tcpsplice){
+  MILL_GUARD("tcpsplice");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[3]->IsNumber())
+    deadline = now() + To<int64_t>(info[3]).FromJust();
+
+  size_t len = SIZE_MAX;
+  if (info[2]->IsNumber()) {
+    int64_t n = To<int64_t>(info[2]).FromJust();
+    if (n < 0)
+      return Nan::ThrowRangeError("tcpsplice len must not be negative");
+    len = n;
+  }
+
+  struct stream src, dst;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &src);
+  stream_tcp(UnwrapPointer<tcpsock>(info[1]), &dst);
+  ssize_t sz = stream_splice(&src, &dst, len, deadline);
+  if (sz < 0)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcpsplice"));
+  iostat_recv(src.stat, sz, (size_t)sz < len && len != SIZE_MAX);
+  iostat_send(dst.stat, sz);
+  ret(New<Number>(sz));
+}
+
+/* Wraps a connected fd, e.g. one from unixrecvfd(), in a tcpsock of its own.
+   The sock owns the fd from here on, tcpclose() closes it. */
+//api: tcpwrap(fd)
+NAN_METHOD(tcpwrap){
+  int fd = To<int>(info[0]).FromJust();
+
+  ipaddr addr;
+  socklen_t slen = sizeof(ipaddr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &slen) == -1)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcpwrap"));
+  tcptune(fd);
+
+  struct mill_tcpconn *conn =
+    (struct mill_tcpconn *)malloc(sizeof(struct mill_tcpconn));
+  assert(conn);
+  tcpconn_init(conn, fd);
+  conn->addr = addr;
+
+  ret(WrapPointer((tcpsock)conn, sizeof(mill_tcpconn)));
+}
+
+/* Timeouts of the async calls on s, in ms, 0 or none turns one off. A recv
+   or send/flush still pending after read or write ms completes with
+   ETIMEDOUT, onidle() is called after idle ms without either completing. */
+//api: tcptimeouts(s, idle, read, write, onidle)
+NAN_METHOD(tcptimeouts){
+  tcpctx_timeouts(tcpctx(UnwrapPointer<tcpsock>(info[0])),
+                  info[1], info[2], info[3], info[4]);
+}
+
+/* drops a frame half received with tcprecvframes, see frame.h */
+static void frame_close(void *s, int fd);
+
 NAN_METHOD(tcpclose){
-  tcpclose(UnwrapPointer<tcpsock>(info[0]));
+  MILL_GUARD("tcpclose");
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  tcpopt_close(s);
+  tcpctx_close(s);
+  frame_close(s, tcpfd(s));
+  stream_pipe_close(s, tcpfd(s));
+  iostat_close(s, tcpfd(s));
+  tcpclose(s);
 }
 
 /******************************************************************************/
 /*  UDP library                                                               */
 /******************************************************************************/
-struct mill_udpsock {
-  int fd;
-  int port;
-};
-
 typedef struct udp_s {
   uv_poll_t poll_handle;
   uv_os_sock_t fd;
   Callback *cb;
   int len;
+  double *stat;
+  struct idle idle; /* see udpidle() */
+
+  /* batched mode, scratch space reused on every wakeup */
+  int batch;
+  uint32_t *lens;
+#ifdef __linux__
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+#endif
 } udp_t;
 
 void udpRead(uv_poll_t *req, int status, int events) {
@@ -382,26 +1373,114 @@ void udpRead(uv_poll_t *req, int status, int events) {
 
     udp_t *ctx;
     ctx = reinterpret_cast<udp_t *>(req);
+    idle_touch(&ctx->idle);
 
-    char buf[ctx->len];
-    ss = recvfrom(ctx->fd, buf, sizeof(buf), 0, (struct sockaddr*)&addr, &slen);
+    char *buf = pool_alloc(ctx->len);
+    ss = recvfrom(ctx->fd, buf, ctx->len, 0, (struct sockaddr*)&addr, &slen);
+    iostat_syscall(ctx->stat, ss);
 
     if(ss >= 0) {
+      iostat_recv(ctx->stat, ss, 0);
       ipaddrstr(addr, ipstr);
       Local<Object> o = New<Object>();
-      Local<Object> h = NewBuffer(ss).ToLocalChecked();
-      memcpy(node::Buffer::Data(h), buf, ss);
+      Local<Object> h = pool_buffer(buf, ss);
 
       Set(o, New("buf").ToLocalChecked(), h);
       Set(o, New("addr").ToLocalChecked(), New<String>(ipstr).ToLocalChecked());
 
       Local<Value> argv[] = { o };
       ctx->cb->Call(1, argv);
+    } else {
+      pool_discard(buf);
     }
   }
 }
 
+/* Drains up to ctx->batch datagrams into ctx->len sized slots of buf, with
+   one recvmmsg on linux and a recvfrom loop elsewhere. */
+static int udprecvmany(udp_t *ctx, char *buf, ipaddr *addrs) {
+  int n = 0;
+#ifdef __linux__
+  for (int i = 0; i < ctx->batch; i++) {
+    ctx->iovs[i].iov_base = buf + (size_t)i * ctx->len;
+    ctx->iovs[i].iov_len = ctx->len;
+    memset(&ctx->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    ctx->msgs[i].msg_hdr.msg_name = &addrs[i];
+    ctx->msgs[i].msg_hdr.msg_namelen = sizeof(ipaddr);
+    ctx->msgs[i].msg_hdr.msg_iov = &ctx->iovs[i];
+    ctx->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg(ctx->fd, ctx->msgs, ctx->batch, MSG_DONTWAIT, NULL);
+  iostat_syscall(ctx->stat, n);
+  if (n < 0)
+    return 0;
+  for (int i = 0; i < n; i++)
+    ctx->lens[i] = ctx->msgs[i].msg_len;
+#else
+  for (; n < ctx->batch; n++) {
+    socklen_t slen = sizeof(ipaddr);
+    ssize_t ss = recvfrom(ctx->fd, buf + (size_t)n * ctx->len, ctx->len,
+      MSG_DONTWAIT, (struct sockaddr*)&addrs[n], &slen);
+    iostat_syscall(ctx->stat, ss);
+    if (ss < 0)
+      break;
+    ctx->lens[n] = ss;
+  }
+#endif
+  return n;
+}
+
+/* Batched udprecv, one JS call per wakeup with
+ *  • buf: all datagrams, datagram i starts at offsets[i]
+ *  • offsets, lengths: Uint32Arrays indexed by datagram
+ *  • addrs: the raw ipaddr of each origin, see ipaddrstr()
+ */
+void udpReadBatch(uv_poll_t *req, int status, int events) {
+  HandleScope scope;
+
+  if (events & UV_READABLE) {
+    udp_t *ctx;
+    ctx = reinterpret_cast<udp_t *>(req);
+    idle_touch(&ctx->idle);
+
+    char *buf = pool_alloc((size_t)ctx->batch * ctx->len);
+    ipaddr *addrs = (ipaddr *)malloc(ctx->batch * sizeof(ipaddr));
+    assert(addrs);
+
+    int n = udprecvmany(ctx, buf, addrs);
+    if (n == 0) {
+      pool_discard(buf);
+      free(addrs);
+      return;
+    }
+
+    Local<ArrayBuffer> ab = ArrayBuffer::New(Isolate::GetCurrent(),
+      2 * n * sizeof(uint32_t));
+    uint32_t *table = (uint32_t *)ab->GetContents().Data();
+    for (int i = 0; i < n; i++) {
+      table[i] = i * ctx->len;
+      table[n + i] = ctx->lens[i];
+      iostat_recv(ctx->stat, ctx->lens[i], 0);
+    }
+
+    /* NewBuffer takes ownership, trim the unused slots first */
+    addrs = (ipaddr *)realloc(addrs, n * sizeof(ipaddr));
+
+    Local<Object> o = New<Object>();
+    Set(o, New("buf").ToLocalChecked(), pool_buffer(buf, (size_t)n * ctx->len));
+    Set(o, New("offsets").ToLocalChecked(), Uint32Array::New(ab, 0, n));
+    Set(o, New("lengths").ToLocalChecked(),
+      Uint32Array::New(ab, n * sizeof(uint32_t), n));
+    Set(o, New("addrs").ToLocalChecked(),
+      NewBuffer((char *)addrs, n * sizeof(ipaddr)).ToLocalChecked());
+
+    Local<Value> argv[] = { o };
+    ctx->cb->Call(1, argv);
+  }
+}
+
 NAN_METHOD(udplisten){
+  MILL_GUARD("udplisten");
   udpsock s = udplisten(*UnwrapPointer<ipaddr*>(info[0]));
   assert(s);
   ret(WrapPointer(s, sizeof(udpsock)));
@@ -413,9 +1492,142 @@ NAN_METHOD(udpport){
 }
 
 NAN_METHOD(udpsend){
+  MILL_GUARD("udpsend");
   udpsock s = UnwrapPointer<udpsock>(info[0]);
   ipaddr addr = *UnwrapPointer<ipaddr*>(info[1]);
   udpsend(s, addr, node::Buffer::Data(info[2]), node::Buffer::Length(info[2]));
+  iostat_send(iostat(s, s->fd), node::Buffer::Length(info[2]));
+}
+
+/* Datagrams handed to the kernel per sendmmsg. UDP_SEGMENT (GSO) bursts are
+   further capped by the kernel's segment limit and the max UDP payload. */
+#define UDP_BATCH 64
+#define UDP_GSO_MAXSEGS 64
+#define UDP_GSO_MAXLEN 65507
+
+static socklen_t udpaddrlen(ipaddr *addr) {
+  return ((struct sockaddr *)addr)->sa_family == AF_INET ?
+    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+/* Sends n datagrams, returns how many the kernel took. Like libmill's
+   udpsend, datagrams that would block are dropped rather than waited on.
+   When the kernel or device refuses a GSO send, the rest of this call goes
+   one msg per datagram; the next call tries GSO again. */
+static int udpsendmany(int fd, ipaddr **addrs, struct iovec *bufs, int n,
+  double *stat) {
+#ifdef __linux__
+  struct mmsghdr msgs[UDP_BATCH];
+#ifdef UDP_SEGMENT
+  char ctrl[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+#endif
+  int sent = 0;
+  int usegso = 1;
+
+  while (sent < n) {
+    int gso = 0;
+    int nmsgs = 0;
+    int i = sent;
+
+    /* one msg per datagram, or per same-destination run when GSO is on */
+    while (i < n && nmsgs < UDP_BATCH) {
+      struct msghdr *hdr = &msgs[nmsgs].msg_hdr;
+      memset(hdr, 0, sizeof(struct msghdr));
+      hdr->msg_name = addrs[i];
+      hdr->msg_namelen = udpaddrlen(addrs[i]);
+      hdr->msg_iov = &bufs[i];
+      hdr->msg_iovlen = 1;
+
+      size_t seglen = bufs[i].iov_len;
+      size_t total = seglen;
+      ++i;
+#ifdef UDP_SEGMENT
+      /* GSO needs equal segments, only the last one may be shorter */
+      while (usegso && seglen && i < n &&
+             hdr->msg_iovlen < UDP_GSO_MAXSEGS &&
+             bufs[i].iov_len <= seglen &&
+             total + bufs[i].iov_len <= UDP_GSO_MAXLEN &&
+             memcmp(addrs[i], hdr->msg_name, sizeof(ipaddr)) == 0) {
+        total += bufs[i].iov_len;
+        hdr->msg_iovlen++;
+        if (bufs[i++].iov_len < seglen)
+          break;
+      }
+      if (hdr->msg_iovlen > 1) {
+        hdr->msg_control = ctrl[nmsgs];
+        hdr->msg_controllen = sizeof(ctrl[nmsgs]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cm) = seglen;
+        gso = 1;
+      }
+#endif
+      nmsgs++;
+    }
+
+    int rc = sendmmsg(fd, msgs, nmsgs, 0);
+    iostat_syscall(stat, rc);
+    if (rc <= 0) {
+#ifdef UDP_SEGMENT
+      if (gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+        usegso = 0;
+        continue;
+      }
+#endif
+      break;
+    }
+    for (int m = 0; m < rc; m++)
+      sent += msgs[m].msg_hdr.msg_iovlen;
+  }
+  return sent;
+#else
+  int sent = 0;
+  for (; sent < n; sent++) {
+    ssize_t ss = sendto(fd, bufs[sent].iov_base, bufs[sent].iov_len, 0,
+      (struct sockaddr *)addrs[sent], udpaddrlen(addrs[sent]));
+    iostat_syscall(stat, ss);
+    if (ss < 0)
+      break;
+  }
+  return sent;
+#endif
+}
+
+//api: udpsendmany(s, [addr, buf, addr, buf, ...])
+NAN_METHOD(udpsendmany){
+  MILL_GUARD("udpsendmany");
+  udpsock s = UnwrapPointer<udpsock>(info[0]);
+  Local<Array> arr = info[1].As<Array>();
+  if (arr->Length() % 2)
+    return Nan::ThrowRangeError("udpsendmany takes addr, buf pairs");
+  int n = arr->Length() / 2;
+  if (n == 0)
+    return ret(New<Number>(0));
+
+  for (uint32_t i = 0; i < arr->Length(); i++)
+    if (!node::Buffer::HasInstance(Nan::Get(arr, i).ToLocalChecked()))
+      return Nan::ThrowTypeError("udpsendmany takes ipaddrs and Buffers");
+
+  ipaddr **addrs = (ipaddr **)malloc(n * sizeof(ipaddr *));
+  struct iovec *bufs = (struct iovec *)malloc(n * sizeof(struct iovec));
+  assert(addrs && bufs);
+
+  for (int i = 0; i < n; i++) {
+    Local<Value> b = Nan::Get(arr, 2 * i + 1).ToLocalChecked();
+    addrs[i] = UnwrapPointer<ipaddr*>(Nan::Get(arr, 2 * i).ToLocalChecked());
+    bufs[i].iov_base = node::Buffer::Data(b);
+    bufs[i].iov_len = node::Buffer::Length(b);
+  }
+
+  double *stat = iostat(s, s->fd);
+  int sent = udpsendmany(s->fd, addrs, bufs, n, stat);
+  for (int i = 0; i < sent; i++)
+    iostat_send(stat, bufs[i].iov_len);
+  free(addrs);
+  free(bufs);
+  ret(New<Number>(sent));
 }
 
 NAN_METHOD(udprecv){
@@ -433,19 +1645,38 @@ NAN_METHOD(udprecv){
     context->cb = cb;
     context->fd = s->fd;
     context->len = len;
+    context->stat = iostat(s, s->fd);
+
+    /* optional 4th param: max datagrams per callback */
+    context->batch = 1;
+    if (info[3]->IsNumber())
+      context->batch = To<int>(info[3]).FromJust();
+    if (context->batch > 1) {
+      context->lens = (uint32_t *)malloc(context->batch * sizeof(uint32_t));
+#ifdef __linux__
+      context->msgs = (struct mmsghdr *)
+        malloc(context->batch * sizeof(struct mmsghdr));
+      context->iovs = (struct iovec *)
+        malloc(context->batch * sizeof(struct iovec));
+#endif
+    }
 
     if (context->fd != 0) {
       uv_poll_init_socket(uv_default_loop(), &context->poll_handle, context->fd);
-      uv_poll_start(&context->poll_handle, UV_READABLE, udpRead);
+      uv_poll_start(&context->poll_handle, UV_READABLE,
+        context->batch > 1 ? udpReadBatch : udpRead);
       ret(WrapPointer(context, 8));
     }
   } else {
-    char buf[len];
+    MILL_GUARD("udprecv");
+    char *buf = pool_alloc(len);
     int deadline = now() + To<int>(info[2]).FromJust();
 
-    size_t sz = udprecv(s, &addr, buf, sizeof(buf), deadline);
-    Local<Object> h = NewBuffer(sz).ToLocalChecked();
-    memcpy(node::Buffer::Data(h), buf, sz);
+    uint64_t t0 = hist_start();
+    size_t sz = udprecv(s, &addr, buf, len, deadline);
+    hist_record(HIST_UDPRECV, t0);
+    iostat_recv(iostat(s, s->fd), sz, !sz && len);
+    Local<Object> h = pool_buffer(buf, sz);
 
     ipaddrstr(addr, ipstr);
 
@@ -461,8 +1692,64 @@ NAN_METHOD(udprecv){
   }
 }
 
+//api: udprecvinto(s, target, offset, len, deadline, addr)
+NAN_METHOD(udprecvinto){
+  MILL_GUARD("udprecvinto");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[4]->IsNumber())
+    deadline = now() + To<int64_t>(info[4]).FromJust();
+
+  size_t len;
+  char *dst = recvinto(info[1], info[2], info[3], &len);
+  if (!dst)
+    return;
+
+  /* the origin is copied out only when an ipaddr sized buffer is passed */
+  ipaddr addr;
+  udpsock s = UnwrapPointer<udpsock>(info[0]);
+  uint64_t t0 = hist_start();
+  size_t sz = udprecv(s, &addr, dst, len, deadline);
+  hist_record(HIST_UDPRECV, t0);
+  iostat_recv(iostat(s, s->fd), sz, !sz && len);
+  if (node::Buffer::HasInstance(info[5]) &&
+      node::Buffer::Length(info[5]) >= sizeof(ipaddr))
+    memcpy(node::Buffer::Data(info[5]), &addr, sizeof(ipaddr));
+
+  ret(New<Number>(sz));
+}
+
+static void udp_free(uv_handle_t *handle) {
+  udp_t *ctx = reinterpret_cast<udp_t *>(handle);
+  idle_free(&ctx->idle);
+  delete ctx->cb;
+  free(ctx->lens);
+#ifdef __linux__
+  free(ctx->msgs);
+  free(ctx->iovs);
+#endif
+  free(ctx);
+}
+
+/* stop an async udprecv, pass the handle it returned */
+NAN_METHOD(udprecvstop){
+  udp_t *ctx = UnwrapPointer<udp_t *>(info[0]);
+  wheel_cancel(&ctx->idle.timer);
+  uv_close((uv_handle_t *)&ctx->poll_handle, udp_free);
+}
+
+/* onidle() after ms without a datagram, ms 0 turns it off */
+//api: udpidle(h, ms, onidle), h is an async udprecv handle
+NAN_METHOD(udpidle){
+  udp_t *ctx = UnwrapPointer<udp_t *>(info[0]);
+  idle_set(&ctx->idle, timeout_ms(info[1]), info[2]);
+}
+
 NAN_METHOD(udpclose){
-  udpclose(UnwrapPointer<udpsock>(info[0]));
+  MILL_GUARD("udpclose");
+  udpsock s = UnwrapPointer<udpsock>(info[0]);
+  iostat_close(s, s->fd);
+  udpclose(s);
 }
 
 /******************************************************************************/
@@ -479,7 +1766,100 @@ NAN_METHOD (sleep) {
 /*  UNIX library                                                              */
 /******************************************************************************/
 
+/* libmill's unix connections share the tcp layout with a page sized buffer */
+#ifndef UNIX_BUFLEN
+#define UNIX_BUFLEN (4096)
+#endif
+
+enum mill_unixtype {
+  MILL_UNIXLISTENER,
+  MILL_UNIXCONN
+};
+
+struct mill_unixsock {
+  enum mill_unixtype type;
+};
+
+struct mill_unixlistener {
+  struct mill_unixsock sock;
+  int fd;
+};
+
+struct mill_unixconn {
+  struct mill_unixsock sock;
+  int fd;
+  size_t ifirst;
+  size_t ilen;
+  size_t olen;
+  char ibuf[UNIX_BUFLEN];
+  char obuf[UNIX_BUFLEN];
+};
+
+/* stats(s) finds unix socks by the tcp layout, see iostat.h */
+static_assert(offsetof(struct mill_unixconn, fd) ==
+  offsetof(struct mill_tcpconn, fd), "unix conn fd moved");
+static_assert(offsetof(struct mill_unixlistener, fd) ==
+  offsetof(struct mill_tcpconn, fd), "unix listener fd moved");
+
+static void stream_unix(unixsock s, struct stream *st) {
+  if (s->type != MILL_UNIXCONN)
+    abort(); // abort trap! stream calls on a listening sock..
+  struct mill_unixconn *conn = (struct mill_unixconn *)s;
+  st->sock = s;
+  st->fd = conn->fd;
+  st->ifirst = &conn->ifirst;
+  st->ilen = &conn->ilen;
+  st->olen = &conn->olen;
+  st->ibuf = conn->ibuf;
+  st->obuf = conn->obuf;
+  st->buflen = UNIX_BUFLEN;
+  st->unbuffered = 0;
+  st->stat = iostat(s, conn->fd);
+}
+
+static int unixfd(unixsock s) {
+  if (s->type == MILL_UNIXLISTENER)
+    return ((struct mill_unixlistener *)s)->fd;
+  return ((struct mill_unixconn *)s)->fd;
+}
+
+/* async unix calls run on the tcp connection contexts */
+static tcp_t *unixctx(unixsock s) {
+  if (s->type != MILL_UNIXCONN)
+    abort(); // abort trap! async recv/send on a listening sock..
+  struct stream st;
+  stream_unix(s, &st);
+  return streamctx(s, &st);
+}
+
+static void unixAccept(uv_poll_t *req, int status, int events) {
+  HandleScope scope;
+  if (events & UV_READABLE) {
+    tcp_t *ctx = reinterpret_cast<tcp_t *>(req);
+    idle_touch(&ctx->idle);
+
+    int as = accept(ctx->fd, NULL, NULL);
+    if (as == -1)
+      return;
+    int opt = fcntl(as, F_GETFL, 0);
+    fcntl(as, F_SETFL, (opt == -1 ? 0 : opt) | O_NONBLOCK);
+
+    struct mill_unixconn *conn =
+      (struct mill_unixconn *)malloc(sizeof(struct mill_unixconn));
+    assert(conn);
+    conn->sock.type = MILL_UNIXCONN;
+    conn->fd = as;
+    conn->ifirst = 0;
+    conn->ilen = 0;
+    conn->olen = 0;
+
+    Local<Value> argv[] = { WrapPointer((unixsock)conn, sizeof(unixsock)) };
+    ctx->cb->Call(1, argv);
+  }
+}
+
 NAN_METHOD(unixlisten){
+  MILL_GUARD("unixlisten");
   String::Utf8Value sockname(info[0]);
   char *name = *sockname;
   struct stat st;
@@ -492,15 +1872,43 @@ NAN_METHOD(unixlisten){
   ret(WrapPointer(ls, sizeof(&ls)));
 }
 
-//TODO: deadline
+//api: unixaccept(ls, deadline | cb)
 NAN_METHOD(unixaccept){
-  unixsock as = unixaccept(UnwrapPointer<unixsock>(info[0]), -1);
+  unixsock s = UnwrapPointer<unixsock>(info[0]);
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[1]->IsNumber())
+    deadline = now() + To<int64_t>(info[1]).FromJust();
+
+  if (info[1]->IsFunction()) {
+    if (s->type != MILL_UNIXLISTENER)
+      abort(); // abort trap! trying to pass non-listening socks..
+
+    tcp_t *ctx = reinterpret_cast<tcp_t *>(calloc(1, sizeof(tcp_t)));
+    assert(ctx);
+    ctx->poll_handle.data = ctx;
+    ctx->cb = new Callback(info[1].As<Function>());
+    ctx->fd = ((struct mill_unixlistener *)s)->fd;
+
+    uv_poll_init_socket(uv_default_loop(), &ctx->poll_handle, ctx->fd);
+    uv_poll_start(&ctx->poll_handle, UV_READABLE, unixAccept);
+
+    return ret(WrapPointer(ctx, sizeof(tcp_t)));
+  }
+
+  MILL_GUARD("unixaccept");
+
+  unixsock as = unixaccept(s, deadline);
+  if (!as && errno == ETIMEDOUT)
+    return ret(Nan::Null());
   assert(as);
 
   ret(WrapPointer(as, sizeof(&as)));
 }
 
 NAN_METHOD(unixconnect){
+  MILL_GUARD("unixconnect");
   String::Utf8Value sockname(info[0]);
   char *name = *sockname;
   unixsock cs = unixconnect(name);
@@ -510,6 +1918,7 @@ NAN_METHOD(unixconnect){
 }
 
 NAN_METHOD(unixpair){
+  MILL_GUARD("unixpair");
   unixsock a = UnwrapPointer<unixsock>(info[0]);
   unixsock b = UnwrapPointer<unixsock>(info[1]);
 
@@ -518,53 +1927,359 @@ NAN_METHOD(unixpair){
   assert(errno == 0);
 }
 
-//TODO: deadline
+//api: unixtimeouts(s, idle, read, write, onidle), see tcptimeouts()
+NAN_METHOD(unixtimeouts){
+  tcpctx_timeouts(unixctx(UnwrapPointer<unixsock>(info[0])),
+                  info[1], info[2], info[3], info[4]);
+}
+
+/* stop an async unixaccept, pass the handle it returned */
+NAN_METHOD(unixacceptstop){
+  tcp_t *ctx = UnwrapPointer<tcp_t *>(info[0]);
+  wheel_cancel(&ctx->idle.timer);
+  uv_close((uv_handle_t *)&ctx->poll_handle, accept_free);
+}
+
+//api: unixsend(s, buf, deadline | cb)
 NAN_METHOD(unixsend){
-  size_t sz = unixsend(UnwrapPointer<unixsock>(info[0]),
-    node::Buffer::Data(info[1]), node::Buffer::Length(info[1]), -1);
+  if (info[2]->IsFunction()) {
+    tcpsend_async(unixctx(UnwrapPointer<unixsock>(info[0])),
+                  node::Buffer::Data(info[1]),
+                  node::Buffer::Length(info[1]),
+                  new Callback(info[2].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("unixsend");
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  unixsock s = UnwrapPointer<unixsock>(info[0]);
+  size_t sz = unixsend(s, node::Buffer::Data(info[1]),
+    node::Buffer::Length(info[1]), deadline);
+  iostat_send(iostat(s, unixfd(s)), sz);
 
   ret(New<Number>(sz));
 }
 
-//TODO: deadline
+//api: unixsendv(s, [bufs], deadline)
+NAN_METHOD(unixsendv){
+  MILL_GUARD("unixsendv");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  if (!stream_checkbufs(info[1]))
+    return;
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  size_t sz = stream_sendbufs(&st, info[1], deadline);
+  if (errno)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "unixsendv"));
+  iostat_send(st.stat, sz);
+  ret(New<Number>(sz));
+}
+
+//api: unixflush(s, deadline | cb)
 NAN_METHOD(unixflush){
-  unixflush(UnwrapPointer<unixsock>(info[0]), -1);
+  if (info[1]->IsFunction()) {
+    tcpsend_async(unixctx(UnwrapPointer<unixsock>(info[0])), NULL, 0,
+                  new Callback(info[1].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("unixflush");
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[1]->IsNumber())
+    deadline = now() + To<int64_t>(info[1]).FromJust();
+
+  unixsock s = UnwrapPointer<unixsock>(info[0]);
+  unixflush(s, deadline);
+  iostat_add(iostat(s, unixfd(s)), IOSTAT_FLUSHES, 1);
 }
 
-//TODO: deadline
+//api: unixrecv(s, len, deadline | cb)
 NAN_METHOD(unixrecv){
-  int rcvbuf = To<int>(info[1]).FromJust();
+  if (info[2]->IsFunction()) {
+    tcprecv_async(unixctx(UnwrapPointer<unixsock>(info[0])),
+                  To<int>(info[1]).FromJust(), NULL,
+                  new Callback(info[2].As<Function>()));
+    return;
+  }
 
-  /* should make it a static char */
-  char buf[rcvbuf];
-  size_t sz = unixrecv(UnwrapPointer<unixsock>(info[0]), buf, rcvbuf, -1);
+  MILL_GUARD("unixrecv");
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  int rcvbuf = To<int>(info[1]).FromJust();
 
-  v8::Local<v8::Object> h = NewBuffer(sz).ToLocalChecked();
-  memcpy(node::Buffer::Data(h), buf, sz);
+  unixsock s = UnwrapPointer<unixsock>(info[0]);
+  char *buf = pool_alloc(rcvbuf);
+  size_t sz = unixrecv(s, buf, rcvbuf, deadline);
+  iostat_recv(iostat(s, unixfd(s)), sz, sz < (size_t)rcvbuf);
 
-  ret(h);
+  ret(pool_buffer(buf, sz));
 }
 
-//TODO: deadline
+//api: unixrecvuntil(s, len, deadline | cb, delims), delims default to '\r'
 NAN_METHOD(unixrecvuntil){
+  struct delims until;
+  if (delims_parse(info[3], &until))
+    return;
+
+  if (info[2]->IsFunction()) {
+    tcprecv_async(unixctx(UnwrapPointer<unixsock>(info[0])),
+                  To<int>(info[1]).FromJust(), &until,
+                  new Callback(info[2].As<Function>()));
+    return;
+  }
+
+  MILL_GUARD("unixrecvuntil");
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
   int rcvbuf = To<int>(info[1]).FromJust();
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+
+  char *buf = pool_alloc(rcvbuf);
+  size_t sz = stream_recvuntil(&st, buf, rcvbuf, &until, deadline);
+  iostat_recv(st.stat, sz, errno != 0);
+
+  ret(pool_buffer(buf, sz));
+}
+
+//api: unixrecvinto(s, target, offset, len, deadline)
+NAN_METHOD(unixrecvinto){
+  MILL_GUARD("unixrecvinto");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[4]->IsNumber())
+    deadline = now() + To<int64_t>(info[4]).FromJust();
+
+  size_t len;
+  char *dst = recvinto(info[1], info[2], info[3], &len);
+  if (!dst)
+    return;
+
   unixsock s = UnwrapPointer<unixsock>(info[0]);
+  size_t sz = unixrecv(s, dst, len, deadline);
+  iostat_recv(iostat(s, unixfd(s)), sz, sz < len);
+  ret(New<Number>(sz));
+}
+
+//api: unixrecvuntilinto(s, target, offset, len, deadline, delims)
+NAN_METHOD(unixrecvuntilinto){
+  MILL_GUARD("unixrecvuntilinto");
+  struct delims until;
+  if (delims_parse(info[5], &until))
+    return;
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[4]->IsNumber())
+    deadline = now() + To<int64_t>(info[4]).FromJust();
+
+  size_t len;
+  char *dst = recvinto(info[1], info[2], info[3], &len);
+  if (!dst)
+    return;
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  size_t sz = stream_recvuntil(&st, dst, len, &until, deadline);
+  iostat_recv(st.stat, sz, errno != 0);
+  ret(New<Number>(sz));
+}
+
+/* Descriptor passing. The fds ride as SCM_RIGHTS ancillary data on a single
+   marker byte, written after obuf so they stay in order with the stream. The
+   marker must be read by unixrecvfd(), a plain recv that buffers it makes the
+   kernel drop the fds along with it. */
+#ifdef MSG_CMSG_CLOEXEC
+#define UNIX_RECVFD_FLAGS MSG_CMSG_CLOEXEC
+#else
+#define UNIX_RECVFD_FLAGS 0
+#endif
+
+#define UNIX_FDMAX 8 /* fds per marker */
+
+union unix_fdctl {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(UNIX_FDMAX * sizeof(int))];
+};
+
+static int unix_sendfds(struct stream *st, const int *fds, int n,
+  int64_t deadline) {
+  assert(n > 0 && n <= UNIX_FDMAX);
+  if (stream_writev(st, NULL, 0, deadline))
+    return -1;
+
+  char mark = 0;
+  struct iovec iov = { &mark, 1 };
+  union unix_fdctl ctl;
+  memset(&ctl, 0, sizeof(ctl));
+
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = ctl.buf;
+  hdr.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+  struct cmsghdr *c = CMSG_FIRSTHDR(&hdr);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(n * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, n * sizeof(int));
+
+  for (;;) {
+    ssize_t sz = sendmsg(st->fd, &hdr, STREAM_NOSIGNAL);
+    iostat_syscall(st->stat, sz);
+    if (sz == 1)
+      return 0;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (!fdwait(st->fd, FDW_OUT, deadline)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+/* Receives exactly n fds. Returns 0, or -1 with errno set. Bytes already
+   sitting in ibuf came before the marker and have to be read first. */
+static int unix_recvfds(struct stream *st, int *fds, int n,
+  int64_t deadline) {
+  assert(n > 0 && n <= UNIX_FDMAX);
+  if (*st->ilen) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  char mark;
+  struct iovec iov = { &mark, 1 };
+  union unix_fdctl ctl;
+  struct msghdr hdr;
+
+  for (;;) {
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = ctl.buf;
+    hdr.msg_controllen = sizeof(ctl.buf);
+
+    ssize_t sz = recvmsg(st->fd, &hdr, UNIX_RECVFD_FLAGS);
+    iostat_syscall(st->stat, sz);
+    if (sz > 0)
+      break;
+    if (sz == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (!fdwait(st->fd, FDW_IN, deadline)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
 
-  char buf[rcvbuf];
-  size_t sz = unixrecvuntil(s, buf, rcvbuf, "\r", 1, -1);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&hdr);
+  if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+    errno = EPROTO;
+    return -1;
+  }
+  int got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  int *p = (int *)CMSG_DATA(c);
+  if (got != n || (hdr.msg_flags & MSG_CTRUNC)) {
+    for (int i = 0; i < got; i++)
+      close(p[i]);
+    errno = EPROTO;
+    return -1;
+  }
+  memcpy(fds, p, n * sizeof(int));
+  return 0;
+}
+
+/* A tcpsock is flushed before its fd goes out. Unread bytes in its ibuf
+   would not travel with the fd, so that is refused with EBUSY. */
+//api: unixsendfd(s, fd | tcpsock, deadline)
+NAN_METHOD(unixsendfd){
+  MILL_GUARD("unixsendfd");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  int fd;
+  if (node::Buffer::HasInstance(info[1])) {
+    tcpsock ts = UnwrapPointer<tcpsock>(info[1]);
+    if (ts->type == MILL_TCPCONN) {
+      struct stream tst;
+      stream_tcp(ts, &tst);
+      if (*tst.ilen) {
+        errno = EBUSY;
+        return Nan::ThrowError(Nan::ErrnoException(errno, "unixsendfd"));
+      }
+      if (stream_writev(&tst, NULL, 0, deadline))
+        return Nan::ThrowError(Nan::ErrnoException(errno, "unixsendfd"));
+    }
+    fd = tcpfd(ts);
+  } else {
+    fd = To<int>(info[1]).FromJust();
+  }
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  if (unix_sendfds(&st, &fd, 1, deadline))
+    return Nan::ThrowError(Nan::ErrnoException(errno, "unixsendfd"));
+}
 
-  Local<Value> h = NewBuffer(sz).ToLocalChecked();
-  memcpy(node::Buffer::Data(h), buf, sz);
+//api: unixrecvfd(s, deadline), null on deadline
+NAN_METHOD(unixrecvfd){
+  MILL_GUARD("unixrecvfd");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[1]->IsNumber())
+    deadline = now() + To<int64_t>(info[1]).FromJust();
 
-  ret(h);
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  int fd;
+  if (unix_recvfds(&st, &fd, 1, deadline)) {
+    if (errno == ETIMEDOUT)
+      return ret(Nan::Null());
+    return Nan::ThrowError(Nan::ErrnoException(errno, "unixrecvfd"));
+  }
+  ret(New<Number>(fd));
 }
 
 NAN_METHOD(unixclose){
-  unixclose(UnwrapPointer<unixsock>(info[0]));
+  MILL_GUARD("unixclose");
+  unixsock s = UnwrapPointer<unixsock>(info[0]);
+  if (s->type == MILL_UNIXCONN)
+    streamctx_close(s, ((struct mill_unixconn *)s)->fd);
+  frame_close(s, unixfd(s));
+  iostat_close(s, unixfd(s));
+  unixclose(s);
 }
 
-NAN_METHOD(goredump){ goredump(); };
-NAN_METHOD(gotrace) { gotrace(1); };
+NAN_METHOD(goredump){ MILL_GUARD("goredump"); goredump(); };
+NAN_METHOD(gotrace) { MILL_GUARD("gotrace"); gotrace(1); };
 
 /* basic test to verify build */
 void worker(int count, const char *text) {
@@ -574,13 +2289,20 @@ void worker(int count, const char *text) {
     }
 }
 NAN_METHOD(test){
+  MILL_GUARD("test");
   go(worker(4, "a"));
   go(worker(2, "b"));
   go(worker(3, "c"));
   msleep(100); return;
 }
 
+#include "frame.h"
+#include "shm.h"
+#include "chan.h"
+#include "coro.h"
+#include "thread.h"
 #include "crypto.h"
+#include "secure.h"
 
 #define T(C,S) Set(C, New(#S).ToLocalChecked(),                                \
   Nan::GetFunction(New<FunctionTemplate>(S)).ToLocalChecked());
@@ -590,43 +2312,130 @@ NAN_MODULE_INIT(Init) {
 
   if (sodium_init() == -1)
     abort();
+  uv_once(&box_hashonce, box_hashseed);
 
   /* ip resolution */
   T(target, iplocal);
   T(target, ipremote);
+  T(target, ipaddrstr);
 
   /* tcp library */
   T(target, tcplisten);
   T(target, tcpaccept);
+  T(target, tcpacceptstop);
+  T(target, acceptidle);
   T(target, tcpconnect);
   T(target, tcpsend);
+  T(target, tcpsendv);
   T(target, tcpflush);
   T(target, tcprecv);
   T(target, tcprecvuntil);
+  T(target, tcprecvinto);
+  T(target, tcprecvuntilinto);
   T(target, tcpport);
+  T(target, tcpopts);
+  T(target, tcpsendfile);
+  T(target, tcpsplice);
+  T(target, tcpwrap);
+  T(target, tcptimeouts);
   T(target, tcpclose);
 
   /* udp library */
   T(target, udplisten);
   T(target, udpport);
   T(target, udpsend);
+  T(target, udpsendmany);
   T(target, udprecv);
+  T(target, udprecvinto);
+  T(target, udprecvstop);
+  T(target, udpidle);
   T(target, udpclose);
 
   /* extensions */
   T(target, sleep);
 
+  /* receive buffer pool */
+  T(target, pool);
+  T(target, release);
+  T(target, poolstats);
+
+  /* I/O counters */
+  T(target, stats);
+  T(target, globalstats);
+  Local<Array> names = New<Array>();
+  for (int i = 0; i < IOSTAT_N; i++)
+    Set(names, i, New(iostat_names[i]).ToLocalChecked());
+  Set(target, New("statnames").ToLocalChecked(), names);
+
+  /* latency histograms */
+  T(target, histsample);
+  T(target, histograms);
+  T(target, histbounds);
+  Local<Array> hnames = New<Array>();
+  for (int i = 0; i < HIST_N; i++)
+    Set(hnames, i, New(hist_names[i]).ToLocalChecked());
+  Set(target, New("histnames").ToLocalChecked(), hnames);
+
   /* unix library */
   T(target, unixlisten);
   T(target, unixaccept);
+  T(target, unixacceptstop);
+  T(target, unixtimeouts);
   T(target, unixconnect);
   T(target, unixpair);
   T(target, unixsend);
+  T(target, unixsendv);
   T(target, unixflush);
   T(target, unixrecv);
   T(target, unixrecvuntil);
+  T(target, unixrecvinto);
+  T(target, unixrecvuntilinto);
+  T(target, unixsendfd);
+  T(target, unixrecvfd);
   T(target, unixclose);
 
+#ifdef __linux__
+  /* shared memory rings */
+  T(target, shmconnect);
+  T(target, shmaccept);
+  T(target, shmsend);
+  T(target, shmflush);
+  T(target, shmrecv);
+  T(target, shmrecvuntil);
+  T(target, shmclose);
+#endif
+
+  /* framing */
+  T(target, tcpsendframe);
+  T(target, tcprecvframes);
+  T(target, unixsendframe);
+  T(target, unixrecvframes);
+
+  /* channels */
+  T(target, chanmake);
+  T(target, chansend);
+  T(target, chanrecv);
+  T(target, chansendmany);
+  T(target, chanrecvmany);
+  T(target, chanchoose);
+  T(target, chandone);
+  T(target, chanclose);
+
+  /* scheduler thread */
+  T(target, threadlisten);
+  T(target, threadsend);
+  T(target, threadclose);
+  T(target, threadstop);
+  T(target, costats);
+  Local<Array> kinds = New<Array>();
+  for (int i = 0; i < CO_NKINDS; i++)
+    Set(kinds, i, New(co_kinds[i]).ToLocalChecked());
+  Set(target, New("cokinds").ToLocalChecked(), kinds);
+  Local<Array> states = New<Array>();
+  for (int i = 0; i < CO_NSTATES; i++)
+    Set(states, i, New(co_states[i]).ToLocalChecked());
+  Set(target, New("costates").ToLocalChecked(), states);
+
   /* debug */
   T(target, gotrace);
   T(target, goredump);
@@ -639,9 +2448,25 @@ NAN_MODULE_INIT(Init) {
   T(target, box_keypair);
   T(target, setk);
   T(target, getk);
+  T(target, box_cache);
+  T(target, box_context);
+  T(target, box_free);
+  T(target, tcpbox);
+  T(target, box_seal);
+  T(target, box_open);
 
   T(target, tcpsendstr);
   T(target, tcprecvsecret);
+
+#ifdef crypto_secretstream_xchacha20poly1305_ABYTES
+  /* encrypted streams */
+  T(target, kx_keypair);
+  T(target, tcpsecure);
+  T(target, unixsecure);
+  T(target, securesend);
+  T(target, securerecv);
+  T(target, secureclose);
+#endif
   //T(target, tcptest);
   //T(target, tcpsendbuf);
   //T(target, tcprecvstr);
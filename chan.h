@@ -0,0 +1,210 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Channels                                                                  */
+/******************************************************************************/
+
+/* libmill channels carrying byte messages. An item owns a heap copy of the
+   sent Buffer until a receiver turns it into a Buffer of its own. A NULL
+   item is what chandone() hands every receiver once the channel is done.
+
+   Every call runs on the node thread, where nothing could wake a waiter:
+   no coroutine there sends or receives, and the scheduler thread keeps to
+   its own channels. So the calls never wait. They are queues between parts
+   of the JS program, a send to a full channel or a recv from an empty one
+   returns right away.
+
+   The chanmake/chansend/... names stay clear of libmill's chmake, chs, chr
+   and choose macros. */
+
+struct chitem {
+  char *data;
+  size_t len;
+};
+
+/* libmill's MILL_CLAUSELEN declares its struct inside sizeof, which C++
+   rejects, so the same layout is spelled out here */
+struct chan_clause {
+  void *f1, *f2, *f3, *f4, *f5, *f6;
+  int f7, f8, f9;
+};
+#define CHAN_CLAUSELEN (sizeof(struct chan_clause))
+
+/* The choose macros need their clauses at compile time; the functions behind
+   them take them at runtime, which lets a choose span any set of channels.
+   Returns the index of the channel received from, -1 when none was ready. */
+static int chan_in(chan *chans, int n, struct chitem *item) {
+  char (*clauses)[CHAN_CLAUSELEN] =
+    (char (*)[CHAN_CLAUSELEN])malloc(n * CHAN_CLAUSELEN);
+  assert(clauses);
+
+  mill_choose_init_(MILL_HERE_);
+  for (int i = 0; i < n; i++)
+    mill_choose_in_(clauses[i], chans[i], sizeof(struct chitem), i);
+  mill_choose_otherwise_();
+
+  int idx = mill_choose_wait_();
+  if (idx >= 0)
+    *item = *(struct chitem *)mill_choose_val_(sizeof(struct chitem));
+  free(clauses);
+  return idx;
+}
+
+/* 1 once the item is in the channel, 0 when it is full */
+static int chan_out(chan ch, struct chitem *item) {
+  char clause[CHAN_CLAUSELEN];
+
+  mill_choose_init_(MILL_HERE_);
+  mill_choose_out_(clause, ch, item, sizeof(struct chitem), 0);
+  mill_choose_otherwise_();
+
+  return mill_choose_wait_() == 0;
+}
+
+static Local<Value> chan_buffer(struct chitem *item) {
+  if (!item->data)
+    return Nan::Null();
+  return NewBuffer(item->data, item->len).ToLocalChecked();
+}
+
+static int chan_send(chan ch, Local<Value> buf) {
+  struct chitem item;
+  item.len = node::Buffer::Length(buf);
+  item.data = (char *)malloc(item.len ? item.len : 1);
+  assert(item.data);
+  memcpy(item.data, node::Buffer::Data(buf), item.len);
+
+  if (chan_out(ch, &item))
+    return 1;
+  free(item.data);
+  return 0;
+}
+
+/* with nobody ever waiting, an unbuffered channel could take nothing */
+//api: chanmake(bufsz), bufsz defaults to 1
+NAN_METHOD(chanmake){
+  MILL_GUARD("chanmake");
+  size_t bufsz = 1;
+  if (info[0]->IsNumber())
+    bufsz = To<uint32_t>(info[0]).FromJust();
+  if (!bufsz)
+    return Nan::ThrowRangeError("channels need room for at least one msg");
+
+  chan ch = chmake(struct chitem, bufsz);
+  assert(ch);
+  ret(WrapPointer(ch, sizeof(chan)));
+}
+
+//api: chansend(ch, buf), false when the channel is full
+NAN_METHOD(chansend){
+  MILL_GUARD("chansend");
+  chan ch = UnwrapPointer<chan>(info[0]);
+  ret(New<Boolean>(chan_send(ch, info[1])));
+}
+
+//api: chanrecv(ch), null when it is empty or once the channel is done
+NAN_METHOD(chanrecv){
+  MILL_GUARD("chanrecv");
+  chan ch = UnwrapPointer<chan>(info[0]);
+  struct chitem item;
+
+  if (chan_in(&ch, 1, &item) < 0)
+    return ret(Nan::Null());
+  ret(chan_buffer(&item));
+}
+
+//api: chansendmany(ch, [bufs]), returns how many went in
+NAN_METHOD(chansendmany){
+  MILL_GUARD("chansendmany");
+  chan ch = UnwrapPointer<chan>(info[0]);
+  Local<Array> bufs = info[1].As<Array>();
+
+  uint32_t i = 0;
+  for (; i < bufs->Length(); i++)
+    if (!chan_send(ch, Nan::Get(bufs, i).ToLocalChecked()))
+      break;
+  ret(New<Number>(i));
+}
+
+/* takes what is ready, up to max items */
+//api: chanrecvmany(ch, max)
+NAN_METHOD(chanrecvmany){
+  MILL_GUARD("chanrecvmany");
+  chan ch = UnwrapPointer<chan>(info[0]);
+  uint32_t max = To<uint32_t>(info[1]).FromJust();
+
+  Local<Array> items = New<Array>();
+  struct chitem item;
+  for (uint32_t i = 0; i < max; i++) {
+    if (chan_in(&ch, 1, &item) < 0)
+      break;
+    Set(items, i, chan_buffer(&item));
+    if (!item.data)
+      break;
+  }
+  ret(items);
+}
+
+//api: chanchoose([ch, ...]), { index, buf } or null when none is ready
+NAN_METHOD(chanchoose){
+  MILL_GUARD("chanchoose");
+  Local<Array> arr = info[0].As<Array>();
+  int n = arr->Length();
+  if (n == 0)
+    return ret(Nan::Null());
+
+  chan *chans = (chan *)malloc(n * sizeof(chan));
+  assert(chans);
+  for (int i = 0; i < n; i++)
+    chans[i] = UnwrapPointer<chan>(Nan::Get(arr, i).ToLocalChecked());
+
+  struct chitem item;
+  int idx = chan_in(chans, n, &item);
+  free(chans);
+  if (idx < 0)
+    return ret(Nan::Null());
+
+  Local<Object> o = New<Object>();
+  Set(o, New("index").ToLocalChecked(), New<Number>(idx));
+  Set(o, New("buf").ToLocalChecked(), chan_buffer(&item));
+  ret(o);
+}
+
+/* every receiver, now and later, gets null */
+NAN_METHOD(chandone){
+  MILL_GUARD("chandone");
+  struct chitem done = { NULL, 0 };
+  chdone(UnwrapPointer<chan>(info[0]), struct chitem, done);
+}
+
+/* drops the items nobody received */
+NAN_METHOD(chanclose){
+  MILL_GUARD("chanclose");
+  chan ch = UnwrapPointer<chan>(info[0]);
+  struct chitem item;
+  while (chan_in(&ch, 1, &item) >= 0 && item.data)
+    free(item.data);
+  chclose(ch);
+}
@@ -0,0 +1,164 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Coroutine registry                                                        */
+/******************************************************************************/
+
+/* libmill keeps its coroutine list and ready queue to itself and only prints
+   them through goredump(), so the coroutines this binding starts register
+   here instead and note what they park on around every wait. The record
+   lives on the coroutine's own stack, and the list is guarded by a mutex the
+   snapshot takes once, so polling it from JS costs one walk over the list.
+
+   A coroutine counts as running while it is not parked in one of the tracked
+   waits: on the cpu, ready to go, or inside a libmill call that did not
+   need to wait. */
+
+enum { CO_ACCEPT, CO_DISPATCH, CO_READER, CO_WRITER, CO_NKINDS };
+enum { CO_RUNNING, CO_FDWAIT, CO_CHWAIT, CO_SLEEP, CO_NSTATES };
+
+static const char *co_kinds[CO_NKINDS] = {
+  "accept", "dispatch", "reader", "writer"
+};
+static const char *co_states[CO_NSTATES] = {
+  "running", "fdwait", "chwait", "sleep"
+};
+
+/* per coroutine fields of a costats() snapshot */
+enum {
+  CO_KIND, CO_STATE, CO_FD, CO_EVENTS,
+  CO_WAITED,   /* ms since it parked */
+  CO_LEFT,     /* ms to its deadline, -1 without one */
+  CO_WAITS,    /* how many times it parked */
+  CO_ID,       /* connection id, 0 for the others */
+  CO_FIELDS
+};
+
+struct co {
+  struct co *prev, *next;
+  int kind;
+  int state;
+  int fd;
+  int events;
+  uint64_t since; /* uv_hrtime() when it parked */
+  uint64_t due;   /* uv_hrtime() of the deadline, 0 without one */
+  double waits;
+  double id;
+};
+
+static struct {
+  uv_once_t once;
+  uv_mutex_t lock;
+  struct co *live;
+  uint32_t n;
+} coreg = { UV_ONCE_INIT };
+
+static void co_init() {
+  uv_mutex_init(&coreg.lock);
+}
+
+static void co_add(struct co *c, int kind, double id) {
+  uv_once(&coreg.once, co_init);
+  memset(c, 0, sizeof *c);
+  c->kind = kind;
+  c->fd = -1;
+  c->id = id;
+
+  uv_mutex_lock(&coreg.lock);
+  c->next = coreg.live;
+  if (coreg.live)
+    coreg.live->prev = c;
+  coreg.live = c;
+  coreg.n++;
+  uv_mutex_unlock(&coreg.lock);
+}
+
+static void co_remove(struct co *c) {
+  uv_mutex_lock(&coreg.lock);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    coreg.live = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  coreg.n--;
+  uv_mutex_unlock(&coreg.lock);
+}
+
+/* Called by the coroutine itself right before a wait. The deadline is
+   turned into hrtime here, libmill's clock must not be read off its thread. */
+static void co_park(struct co *c, int state, int fd, int events,
+  int64_t deadline) {
+  uint64_t t = uv_hrtime();
+  int64_t left = deadline < 0 ? 0 : deadline - now();
+
+  uv_mutex_lock(&coreg.lock);
+  c->state = state;
+  c->fd = fd;
+  c->events = events;
+  c->since = t;
+  c->due = deadline < 0 ? 0 : t + (left > 0 ? left : 0) * 1000000;
+  c->waits++;
+  uv_mutex_unlock(&coreg.lock);
+}
+
+static void co_resume(struct co *c) {
+  uv_mutex_lock(&coreg.lock);
+  c->state = CO_RUNNING;
+  uv_mutex_unlock(&coreg.lock);
+}
+
+/* Every registered coroutine as one Float64Array: a count per state in
+   costates order, then CO_FIELDS numbers per coroutine. Safe to call while
+   the scheduler thread runs, it does not enter libmill. */
+NAN_METHOD(costats){
+  uv_once(&coreg.once, co_init);
+  uv_mutex_lock(&coreg.lock);
+
+  size_t len = CO_NSTATES + (size_t)coreg.n * CO_FIELDS;
+  Local<ArrayBuffer> ab = ArrayBuffer::New(Isolate::GetCurrent(),
+    len * sizeof(double));
+  double *v = (double *)ab->GetContents().Data();
+  memset(v, 0, CO_NSTATES * sizeof(double));
+
+  uint64_t t = uv_hrtime();
+  double *f = v + CO_NSTATES;
+  for (struct co *c = coreg.live; c; c = c->next, f += CO_FIELDS) {
+    int parked = c->state != CO_RUNNING;
+    v[c->state]++;
+    f[CO_KIND] = c->kind;
+    f[CO_STATE] = c->state;
+    f[CO_FD] = parked ? c->fd : -1;
+    f[CO_EVENTS] = parked ? c->events : 0;
+    f[CO_WAITED] = parked ? (t - c->since) / 1e6 : 0;
+    f[CO_LEFT] = parked && c->due ?
+      (c->due > t ? (c->due - t) / 1e6 : 0) : -1;
+    f[CO_WAITS] = c->waits;
+    f[CO_ID] = c->id;
+  }
+
+  uv_mutex_unlock(&coreg.lock);
+  ret(Float64Array::New(ab, 0, len));
+}
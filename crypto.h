@@ -1,20 +1,3 @@
-#define MAX_INPUT_LEN 4096
-
-static unsigned char ciphertext[crypto_box_MACBYTES + MAX_INPUT_LEN];
-static unsigned char msg[MAX_INPUT_LEN]; /* reinterpreted msg */
-
-static unsigned char nonce[crypto_box_NONCEBYTES]; /* nonce      */
-static size_t nsz = crypto_box_NONCEBYTES;
-static char nhex[crypto_box_NONCEBYTES * 2 + 1];    /* nonce hex  */
-
-static unsigned char pk[crypto_box_PUBLICKEYBYTES]; /* public key */
-static unsigned char sk[crypto_box_SECRETKEYBYTES]; /* secret key */
-static char key[crypto_box_PUBLICKEYBYTES * 2 + 1];
-static size_t psz = crypto_box_PUBLICKEYBYTES * 2 + 1;
-static size_t ssz = crypto_box_SECRETKEYBYTES * 2 + 1;
-static size_t ksz = 48;
-static size_t cphr_len;
-
 /*
  * print_hex() is a wrapper around sodium_bin2hex() which allocates
  * temporary memory then immediately prints the result followed by \n
@@ -38,42 +21,322 @@ static void print_hex(const void *bin, const size_t bin_len) {
   free(hex);
 }
 
-/* nbuf uses a pointer kept back in the binding */
-static char *nbuf() {
-  size_t sz = crypto_box_NONCEBYTES;
-  randombytes_buf(&nonce, sz);
-  sodium_bin2hex(nhex, sz * 2 + 1, (unsigned char *)nonce, sz);
-  return nhex;
+/*
+ * A crypto context: a keypair, the nonce counter of the messages it seals,
+ * its cache of shared keys and scratch space for the hex wire format. Calls
+ * that are given no context use boxdef, the process-wide one the original
+ * single keypair API works on. A context touches no globals, so one thread
+ * at a time may use it.
+ */
+#define BOX_CACHE_SIZE 256
+
+/* crypto_box_beforenm() keys, one per peer public key, so each message only
+   pays for the symmetric cipher. LRU list plus a hash table keyed with
+   crypto_shorthash: peers pick their own public keys, so buckets taken
+   straight from the key's bytes could be flooded into one long chain. */
+struct box_shared {
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  unsigned char k[crypto_box_BEFORENMBYTES];
+  struct box_shared *prev, *next; /* LRU order, most recent first */
+  struct box_shared *chain;       /* hash bucket */
+};
+
+struct box_lru {
+  size_t cap;
+  size_t size;
+  size_t nbuckets;
+  struct box_shared **buckets;
+  struct box_shared *head, *tail;
+  double hits;
+  double misses;
+};
+
+struct boxctx {
+  unsigned char pk[crypto_box_PUBLICKEYBYTES]; /* public key */
+  unsigned char sk[crypto_box_SECRETKEYBYTES]; /* secret key */
+  unsigned char nonce[crypto_box_NONCEBYTES];  /* random start, then +1 */
+  int seeded;
+  struct box_lru cache;
+
+  /* scratch, grown as needed */
+  unsigned char *cbuf; /* ciphertext */
+  size_t cbufsz;
+  char *tbuf;          /* wire text */
+  size_t tbufsz;
+
+  int refs;            /* JS handle plus bound connections */
+};
+
+static struct boxctx boxdef;
+
+/* SipHash key, random per process. Seeded from Init, before any context
+   can be used from another thread; once only, since a second load of the
+   addon must not rehash the caches already filled. */
+static unsigned char box_hashkey[crypto_shorthash_KEYBYTES];
+static uv_once_t box_hashonce = UV_ONCE_INIT;
+
+static void box_hashseed() {
+  randombytes_buf(box_hashkey, sizeof box_hashkey);
+}
+
+static struct box_shared **box_bucket(struct box_lru *c,
+  const unsigned char *peer) {
+  unsigned char out[crypto_shorthash_BYTES];
+  uint64_t h;
+  crypto_shorthash(out, peer, crypto_box_PUBLICKEYBYTES, box_hashkey);
+  memcpy(&h, out, sizeof h);
+  return &c->buckets[h & (c->nbuckets - 1)];
+}
+
+static void box_unlink(struct box_lru *c, struct box_shared *e) {
+  if (e->prev) e->prev->next = e->next; else c->head = e->next;
+  if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+}
+
+static void box_push(struct box_lru *c, struct box_shared *e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head) c->head->prev = e; else c->tail = e;
+  c->head = e;
+}
+
+static void box_cache_flush(struct box_lru *c) {
+  struct box_shared *e = c->head;
+  while (e) {
+    struct box_shared *next = e->next;
+    sodium_memzero(e, sizeof *e);
+    free(e);
+    e = next;
+  }
+  free(c->buckets);
+  c->buckets = NULL;
+  c->nbuckets = 0;
+  c->head = c->tail = NULL;
+  c->size = 0;
+}
+
+/* the shared key between peer and ctx's sk, NULL for an unusable peer key */
+static const unsigned char *box_shared_key(struct boxctx *ctx,
+  const unsigned char *peer) {
+  struct box_lru *c = &ctx->cache;
+  if (!c->cap)
+    c->cap = BOX_CACHE_SIZE;
+  if (!c->buckets) {
+    c->nbuckets = 1;
+    while (c->nbuckets < c->cap * 2)
+      c->nbuckets <<= 1;
+    c->buckets = (struct box_shared **)
+      calloc(c->nbuckets, sizeof(struct box_shared *));
+    assert(c->buckets);
+  }
+
+  struct box_shared **b = box_bucket(c, peer);
+  for (struct box_shared *e = *b; e; e = e->chain) {
+    if (memcmp(e->pk, peer, sizeof e->pk) == 0) {
+      c->hits++;
+      box_unlink(c, e);
+      box_push(c, e);
+      return e->k;
+    }
+  }
+  c->misses++;
+
+  /* full, recycle the least recently used entry */
+  struct box_shared *e;
+  if (c->size == c->cap && c->tail) {
+    e = c->tail;
+    struct box_shared **p = box_bucket(c, e->pk);
+    while (*p != e)
+      p = &(*p)->chain;
+    *p = e->chain;
+    box_unlink(c, e);
+  } else {
+    e = (struct box_shared *)malloc(sizeof *e);
+    assert(e);
+    c->size++;
+  }
+
+  memcpy(e->pk, peer, sizeof e->pk);
+  if (crypto_box_beforenm(e->k, peer, ctx->sk)) {
+    sodium_memzero(e, sizeof *e);
+    free(e);
+    c->size--;
+    return NULL;
+  }
+  e->chain = *b;
+  *b = e;
+  box_push(c, e);
+  return e->k;
+}
+
+/* next nonce, unique for as long as the keypair is in use */
+static const unsigned char *box_nonce(struct boxctx *ctx) {
+  if (!ctx->seeded) {
+    randombytes_buf(ctx->nonce, sizeof ctx->nonce);
+    ctx->seeded = 1;
+  } else {
+    sodium_increment(ctx->nonce, sizeof ctx->nonce);
+  }
+  return ctx->nonce;
+}
+
+static void box_setkeys(struct boxctx *ctx, const unsigned char *pk,
+  const unsigned char *sk) {
+  box_cache_flush(&ctx->cache);
+  memcpy(ctx->pk, pk, sizeof ctx->pk);
+  memcpy(ctx->sk, sk, sizeof ctx->sk);
+  ctx->seeded = 0;
+}
+
+static int box_reserve(void *buf, size_t *sz, size_t len) {
+  void **p = (void **)buf;
+  if (len <= *sz)
+    return 0;
+  void *n = realloc(*p, len);
+  if (!n)
+    return -1;
+  *p = n;
+  *sz = len;
+  return 0;
 }
 
-size_t reinterpret_str (const char *input, unsigned char *cast) {
-  //TODO: zero out char cast data
-  unsigned long long len = strlen(input);
-  memcpy(cast, input, len);
-  return len;
+static void box_retain(struct boxctx *ctx) {
+  if (ctx && ctx != &boxdef)
+    ctx->refs++;
 }
 
-size_t reinterpret_buf (const char *input, char *cast) {
-  //TODO: zero out char cast data
-  size_t len = strlen(input);
-  memcpy(cast, input, len);
-  return len;
+static void box_release(struct boxctx *ctx) {
+  if (!ctx || ctx == &boxdef || --ctx->refs > 0)
+    return;
+  box_cache_flush(&ctx->cache);
+  free(ctx->cbuf);
+  free(ctx->tbuf);
+  sodium_memzero(ctx, sizeof *ctx);
+  free(ctx);
 }
 
-int chop(char *str, int begin, int len) {
-  int l = strlen(str);
+/* optional context param, boxdef when none is passed */
+static struct boxctx *box_arg(Local<Value> v) {
+  if (node::Buffer::HasInstance(v))
+    return UnwrapPointer<struct boxctx *>(v);
+  return &boxdef;
+}
 
-  if (len < 0) len = l - begin;
-  if (begin + len > l) len = l - begin;
-  memmove(str + begin, str + begin + len, l - len + 1);
+/* the context bound to a tcp connection, boxdef when none is */
+static struct boxctx *tcpbox_get(tcpsock s) {
+  struct tcpopt *o = tcpopt(s, 0);
+  return o && o->box ? o->box : &boxdef;
+}
+
+/* optional peer public key param, a Buffer or a hex string, defaults to the
+   context's own pk. Returns NULL and throws on a malformed key. */
+static const unsigned char *box_peer(Local<Value> v, struct boxctx *ctx,
+  unsigned char *peer) {
+  if (v->IsUndefined() || v->IsNull())
+    return ctx->pk;
+
+  size_t len = 0;
+  if (node::Buffer::HasInstance(v)) {
+    len = node::Buffer::Length(v);
+    if (len == crypto_box_PUBLICKEYBYTES)
+      memcpy(peer, node::Buffer::Data(v), len);
+  } else if (v->IsString()) {
+    utf8 hex(v);
+    if (sodium_hex2bin(peer, crypto_box_PUBLICKEYBYTES, *hex, hex.length(),
+        NULL, &len, NULL))
+      len = 0;
+  }
+  if (len != crypto_box_PUBLICKEYBYTES) {
+    Nan::ThrowRangeError("peer public key must be 32 bytes");
+    return NULL;
+  }
+  return peer;
+}
+
+/* a Buffer or hex string key of exactly len bytes */
+static int box_key(Local<Value> v, unsigned char *key, size_t len) {
+  size_t got = 0;
+  if (node::Buffer::HasInstance(v)) {
+    got = node::Buffer::Length(v);
+    if (got == len)
+      memcpy(key, node::Buffer::Data(v), len);
+  } else if (v->IsString()) {
+    utf8 hex(v);
+    if (sodium_hex2bin(key, len, *hex, hex.length(), NULL, &got, NULL))
+      got = 0;
+  }
+  return got == len ? 0 : -1;
+}
+
+//api: box_context({ pk, sk }), a new context, with a fresh keypair if none
+NAN_METHOD(box_context){
+  struct boxctx *ctx = (struct boxctx *)calloc(1, sizeof(struct boxctx));
+  assert(ctx);
+  ctx->refs = 1;
+
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
+  if (info[0]->IsObject()) {
+    Local<Object> o = info[0].As<Object>();
+    if (box_key(Nan::Get(o, New("pk").ToLocalChecked()).ToLocalChecked(),
+          pk, sizeof pk) ||
+        box_key(Nan::Get(o, New("sk").ToLocalChecked()).ToLocalChecked(),
+          sk, sizeof sk)) {
+      free(ctx);
+      return Nan::ThrowRangeError("box keys must be 32 bytes");
+    }
+  } else {
+    crypto_box_keypair(pk, sk);
+  }
+  box_setkeys(ctx, pk, sk);
+  sodium_memzero(sk, sizeof sk);
+
+  ret(WrapPointer(ctx, sizeof(struct boxctx *)));
+}
 
-  return len;
+/* drops the JS reference, the context lives on while connections use it */
+NAN_METHOD(box_free){
+  box_release(UnwrapPointer<struct boxctx *>(info[0]));
+}
+
+//api: tcpbox(s, ctx), ctx seals and opens the connection's messages
+NAN_METHOD(tcpbox){
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  struct boxctx *ctx = box_arg(info[1]);
+  struct tcpopt *o = tcpopt(s, 1);
+
+  box_retain(ctx);
+  box_release(o->box);
+  o->box = ctx == &boxdef ? NULL : ctx;
+}
+
+//api: box_cache(capacity, ctx), returns { size, capacity, hits, misses }
+NAN_METHOD(box_cache){
+  struct box_lru *c = &box_arg(info[1])->cache;
+  if (!c->cap)
+    c->cap = BOX_CACHE_SIZE;
+  if (info[0]->IsNumber()) {
+    box_cache_flush(c);
+    c->cap = To<uint32_t>(info[0]).FromJust();
+    if (!c->cap)
+      c->cap = 1;
+  }
+
+  Local<Object> o = New<Object>();
+  Set(o, New("size").ToLocalChecked(), New<Number>(c->size));
+  Set(o, New("capacity").ToLocalChecked(), New<Number>(c->cap));
+  Set(o, New("hits").ToLocalChecked(), New<Number>(c->hits));
+  Set(o, New("misses").ToLocalChecked(), New<Number>(c->misses));
+  ret(o);
 }
 
 /* return a nonce hex to node */
 NAN_METHOD(nstr){
-  char *n = nbuf();
-  ret(New(n).ToLocalChecked());
+  unsigned char n[crypto_box_NONCEBYTES];
+  char hex[crypto_box_NONCEBYTES * 2 + 1];
+  randombytes_buf(n, sizeof n);
+  sodium_bin2hex(hex, sizeof hex, n, sizeof n);
+  ret(New(hex).ToLocalChecked());
 }
 
 /* return the crypto_box_primitive */
@@ -88,82 +351,311 @@ NAN_METHOD(sodium_version){
   ret(New( sodium_version ).ToLocalChecked());
 }
 
+//api: box_keypair(ctx)
 NAN_METHOD(box_keypair){
-  crypto_box_keypair((unsigned char *)&pk, (unsigned char *)&sk);
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
+  crypto_box_keypair(pk, sk);
+  box_setkeys(box_arg(info[0]), pk, sk);
+  sodium_memzero(sk, sizeof sk);
 }
 
+//api: setk(pkhex, skhex, ctx)
 NAN_METHOD(setk){
-  utf8 kp(info[0]);
-  utf8 ks(info[1]);
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
 
-  if (sodium_hex2bin((unsigned char *)&pk, 4096, *kp, psz, NULL, NULL, NULL))
-    abort();
-  if (sodium_hex2bin((unsigned char *)&sk, 4096, *ks, ssz, NULL, NULL, NULL))
+  if (box_key(info[0], pk, sizeof pk) || box_key(info[1], sk, sizeof sk))
     abort();
+  box_setkeys(box_arg(info[2]), pk, sk);
+  sodium_memzero(sk, sizeof sk);
 }
 
+//api: getk(ctx)
 NAN_METHOD(getk){
+  struct boxctx *ctx = box_arg(info[0]);
+  char key[crypto_box_SECRETKEYBYTES * 2 + 1];
   Local<Object> o = New<Object>();
 
-  if (!sodium_bin2hex((char *)&key, ksz *2 +1, (unsigned char *)pk, sizeof pk))
-    abort();
+  sodium_bin2hex(key, sizeof key, ctx->pk, sizeof ctx->pk);
   Set(o, New("pk").ToLocalChecked(), New<String>(key).ToLocalChecked());
 
-  if (!sodium_bin2hex((char *)&key, ksz *2 +1, (unsigned char *)sk, sizeof sk))
-    abort();
+  sodium_bin2hex(key, sizeof key, ctx->sk, sizeof ctx->sk);
   Set(o, New("sk").ToLocalChecked(), New<String>(key).ToLocalChecked());
+  sodium_memzero(key, sizeof key);
 
   ret(o);
 }
 
+/* wire format: nonce hex, 's', ciphertext hex, NUL */
+#define BOX_NONCEHEX (crypto_box_NONCEBYTES * 2)
 
-//api: tcpsendstr(s, str)
+//api: tcpsendstr(s, str, peerpk), sealed with the connection's context
 NAN_METHOD(tcpsendstr){
-  unsigned char msg[MAX_INPUT_LEN]; /* reinterpreted msg, try to reuse later */
-  size_t msz;
-
+  MILL_GUARD("tcpsendstr");
   //TODO: deadline control
   int64_t deadline = -1;
 
   tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  struct boxctx *ctx = tcpbox_get(s);
   utf8 str(info[1]);
-
-  unsigned long long len = reinterpret_str(*str, (unsigned char *)msg);
-  randombytes_buf(&nonce, crypto_box_NONCEBYTES);
-
-  if(crypto_box_easy(ciphertext, msg, len, (unsigned char *)nonce, pk, sk))
+  uint64_t t0 = hist_start();
+
+  unsigned char peer[crypto_box_PUBLICKEYBYTES];
+  const unsigned char *k, *p = box_peer(info[2], ctx, peer);
+  if (!p)
+    return;
+  if (!(k = box_shared_key(ctx, p)))
+    return Nan::ThrowError("unusable peer public key");
+
+  size_t len = str.length();
+  size_t clen = crypto_box_MACBYTES + len;
+  size_t sz = BOX_NONCEHEX + 1 + clen * 2 + 1;
+  if (box_reserve(&ctx->cbuf, &ctx->cbufsz, clen) ||
+      box_reserve(&ctx->tbuf, &ctx->tbufsz, sz))
     abort();
-  sodium_bin2hex(nhex, nsz * 2 + 1, (unsigned char *)nonce, nsz);
 
-  cphr_len = crypto_box_MACBYTES + len;
-  msz = sizeof ciphertext * 2 + 1;
-  char msgout[msz];
-  sodium_bin2hex(msgout, msz, ciphertext, cphr_len);
-  size_t sz = strlen(nhex) + strlen(msgout) + 1;
+  const unsigned char *nonce = box_nonce(ctx);
+  if (crypto_box_easy_afternm(ctx->cbuf, (unsigned char *)*str, len, nonce, k))
+    abort();
 
-  char final[sz];
-  snprintf(final, sz, "%s%s%s", nhex, "s", msgout);
+  sodium_bin2hex(ctx->tbuf, BOX_NONCEHEX + 1, nonce, crypto_box_NONCEBYTES);
+  ctx->tbuf[BOX_NONCEHEX] = 's';
+  sodium_bin2hex(ctx->tbuf + BOX_NONCEHEX + 1, clen * 2 + 1, ctx->cbuf, clen);
 
-  sz = tcpsend(s, final, sz, deadline);
+  sz = tcpsend(s, ctx->tbuf, sz, deadline);
+  hist_record(HIST_SENDSTR, t0);
   ret(New<Number>(sz));
 }
 
+//api: tcprecvsecret(s, len, peerpk), opened with the connection's context
 NAN_METHOD(tcprecvsecret){
-  size_t msz;
+  MILL_GUARD("tcprecvsecret");
+  tcpsock s = UnwrapPointer<tcpsock>(info[0]);
+  struct boxctx *ctx = tcpbox_get(s);
+
+  unsigned char peer[crypto_box_PUBLICKEYBYTES];
+  const unsigned char *k, *p = box_peer(info[2], ctx, peer);
+  if (!p)
+    return;
+  if (!(k = box_shared_key(ctx, p)))
+    return Nan::ThrowError("unusable peer public key");
+
+  uint64_t t0 = hist_start();
+  size_t bsz = To<uint32_t>(info[1]).FromJust();
+  if (box_reserve(&ctx->tbuf, &ctx->tbufsz, bsz + 1) ||
+      box_reserve(&ctx->cbuf, &ctx->cbufsz, bsz / 2 + 1))
+    abort();
+  size_t sz = tcprecv(s, ctx->tbuf, bsz, -1);
+  ctx->tbuf[sz] = '\0';
+
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  size_t nlen = 0, clen = 0;
+  if (sz < BOX_NONCEHEX + 1 ||
+      sodium_hex2bin(nonce, sizeof nonce, ctx->tbuf, BOX_NONCEHEX,
+        NULL, &nlen, NULL) || nlen != sizeof nonce ||
+      sodium_hex2bin(ctx->cbuf, ctx->cbufsz, ctx->tbuf + BOX_NONCEHEX + 1,
+        strlen(ctx->tbuf + BOX_NONCEHEX + 1), NULL, &clen, NULL) ||
+      clen < crypto_box_MACBYTES)
+    return Nan::ThrowError("malformed secret message");
+
+  /* opened in place, the plaintext is shorter than the hex it came from */
+  char *m = ctx->tbuf;
+  if (crypto_box_open_easy_afternm((unsigned char *)m, ctx->cbuf, clen, nonce,
+      k))
+    return Nan::ThrowError("secret message failed verification");
+  hist_record(HIST_RECVSECRET, t0);
+
+  ret(New<String>(m, clen - crypto_box_MACBYTES).ToLocalChecked());
+}
+
+/*
+ * Async seal and open on the libuv threadpool. The shared key and nonces are
+ * taken from the context on the JS thread, so workers touch no context
+ * state. Small messages are grouped into work items of about BOX_BATCH
+ * bytes, big ones get one each. Callbacks fire in the order the calls were
+ * made, with results in the order of their inputs.
+ *
+ * sealed messages are nonce + crypto_box ciphertext
+ */
+#define BOX_BATCH (64 * 1024)
+#define BOX_SEALBYTES (crypto_box_NONCEBYTES + crypto_box_MACBYTES)
+
+struct box_item {
+  const unsigned char *in;
+  size_t inlen;
+  unsigned char *out;  /* NULL once an open failed */
+  size_t outlen;
+  unsigned char nonce[crypto_box_NONCEBYTES];
+};
+
+struct box_job {
+  Callback *cb;
+  Nan::Persistent<Value> bufs; /* keeps the inputs alive */
+  unsigned char k[crypto_box_BEFORENMBYTES];
+  int open;
+  uint64_t t0;                 /* hist_start() at the call */
+  uint32_t n;
+  struct box_item *items;
+  size_t pending;              /* work items still running */
+  struct box_job *next;
+};
+
+struct box_work {
+  uv_work_t req;
+  struct box_job *job;
+  uint32_t first;
+  uint32_t count;
+};
+
+/* jobs in call order */
+static struct box_job *boxjobs, *boxjobs_tail;
+
+static void box_work_run(uv_work_t *req) {
+  struct box_work *w = (struct box_work *)req;
+  struct box_job *job = w->job;
+
+  for (uint32_t i = w->first; i < w->first + w->count; i++) {
+    struct box_item *it = &job->items[i];
+    if (!job->open) {
+      memcpy(it->out, it->nonce, crypto_box_NONCEBYTES);
+      crypto_box_easy_afternm(it->out + crypto_box_NONCEBYTES, it->in,
+        it->inlen, it->nonce, job->k);
+    } else if (it->out && crypto_box_open_easy_afternm(it->out,
+        it->in + crypto_box_NONCEBYTES, it->inlen - crypto_box_NONCEBYTES,
+        it->in, job->k)) {
+      free(it->out);
+      it->out = NULL;
+    }
+  }
+}
 
-  int bsz = To<int>(info[1]).FromJust();
-  char buf[bsz];
-  size_t sz = tcprecv(UnwrapPointer<tcpsock>(info[0]), buf, bsz, -1);
-  buf[sz] = '\0';
+static void box_job_done(struct box_job *job) {
+  Local<Array> results = New<Array>(job->n);
+  int err = 0;
+  for (uint32_t i = 0; i < job->n; i++) {
+    struct box_item *it = &job->items[i];
+    if (!it->out) {
+      err = EBADMSG;
+      Set(results, i, Nan::Null());
+      continue;
+    }
+    Set(results, i, NewBuffer((char *)it->out, it->outlen).ToLocalChecked());
+  }
+
+  hist_record(job->open ? HIST_BOXOPEN : HIST_BOXSEAL, job->t0);
+  Callback *cb = job->cb;
+  job->bufs.Reset();
+  sodium_memzero(job->k, sizeof job->k);
+  free(job->items);
+  delete job;
+
+  Local<Value> argv[] = { results, New<Number>(err) };
+  cb->Call(2, argv);
+  delete cb;
+}
 
-  strncpy(nhex, buf, 48);
-  sodium_hex2bin((unsigned char *)&nonce, 4096, nhex, nsz, NULL, NULL, NULL);
+static void box_work_after(uv_work_t *req, int status) {
+  HandleScope scope;
+  struct box_work *w = (struct box_work *)req;
+  w->job->pending--;
+  free(w);
+
+  /* only the oldest jobs may complete, later ones wait their turn */
+  while (boxjobs && !boxjobs->pending) {
+    struct box_job *job = boxjobs;
+    boxjobs = job->next;
+    if (!boxjobs)
+      boxjobs_tail = NULL;
+    box_job_done(job);
+  }
+}
 
-  chop(buf, 0, 49);
-  sodium_hex2bin((unsigned char *)&ciphertext, 4096, buf, sizeof buf, NULL, &msz, NULL);
+static void box_queue(struct box_job *job, uint32_t first, uint32_t count) {
+  struct box_work *w = (struct box_work *)malloc(sizeof(struct box_work));
+  assert(w);
+  w->job = job;
+  w->first = first;
+  w->count = count;
+  job->pending++;
+  uv_queue_work(uv_default_loop(), &w->req, box_work_run, box_work_after);
+}
 
-  char msgrecv[(sz-49)/2 - 1];
-  crypto_box_open_easy((unsigned char *)&msgrecv, ciphertext, msz, nonce, pk, sk);
+static void box_async(Local<Value> bufs, Local<Value> peerv, Local<Value> cbv,
+  Local<Value> ctxv, int open) {
+  struct boxctx *ctx = box_arg(ctxv);
+  unsigned char peer[crypto_box_PUBLICKEYBYTES];
+  const unsigned char *k, *p = box_peer(peerv, ctx, peer);
+  if (!p)
+    return;
+  if (!(k = box_shared_key(ctx, p)))
+    return Nan::ThrowError("unusable peer public key");
+
+  uint32_t n = 1;
+  Local<Array> arr;
+  if (bufs->IsArray()) {
+    arr = bufs.As<Array>();
+    n = arr->Length();
+  }
+
+  struct box_job *job = new box_job();
+  job->cb = new Callback(cbv.As<Function>());
+  job->bufs.Reset(bufs);
+  memcpy(job->k, k, sizeof job->k);
+  job->open = open;
+  job->t0 = hist_start();
+  job->n = n;
+  job->items = (struct box_item *)calloc(n ? n : 1, sizeof(struct box_item));
+  assert(job->items);
+  job->pending = 1; /* held until every work item is queued */
+  job->next = NULL;
+  if (boxjobs_tail)
+    boxjobs_tail->next = job;
+  else
+    boxjobs = job;
+  boxjobs_tail = job;
+
+  uint32_t first = 0;
+  size_t batch = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> b = bufs->IsArray() ? Nan::Get(arr, i).ToLocalChecked() : bufs;
+    struct box_item *it = &job->items[i];
+    it->in = (const unsigned char *)node::Buffer::Data(b);
+    it->inlen = node::Buffer::Length(b);
+
+    if (!open) {
+      memcpy(it->nonce, box_nonce(ctx), sizeof it->nonce);
+      it->outlen = it->inlen + BOX_SEALBYTES;
+    } else {
+      it->outlen = it->inlen >= BOX_SEALBYTES ? it->inlen - BOX_SEALBYTES : 0;
+    }
+    if (!open || it->inlen >= BOX_SEALBYTES) {
+      it->out = (unsigned char *)malloc(it->outlen ? it->outlen : 1);
+      assert(it->out);
+    }
+
+    /* close the batch once it is big enough */
+    batch += it->inlen;
+    if (batch >= BOX_BATCH) {
+      box_queue(job, first, i + 1 - first);
+      first = i + 1;
+      batch = 0;
+    }
+  }
+  /* an empty job still takes a trip through the pool, so its callback never
+     runs before box_seal/box_open return */
+  if (first < n || n == 0)
+    box_queue(job, first, n - first);
+  job->pending--;
+}
+
+//api: box_seal(buf | [bufs], peerpk, cb([sealed], errno), ctx)
+NAN_METHOD(box_seal){
+  box_async(info[0], info[1], info[2], info[3], 0);
+}
 
-  ret(New<String>(msgrecv).ToLocalChecked());
+/* messages that fail verification come back as null, errno EBADMSG */
+//api: box_open(buf | [bufs], peerpk, cb([msgs], errno), ctx)
+NAN_METHOD(box_open){
+  box_async(info[0], info[1], info[2], info[3], 1);
 }
@@ -0,0 +1,378 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Framing                                                                   */
+/******************************************************************************/
+
+/* Length-prefixed frames, either a fixed 4-byte big-endian length or an
+   unsigned LEB128 varint. Complete frames are parsed straight out of ibuf,
+   several per call; sends put headers and bodies in one gather write.
+
+   Bodies larger than ibuf are read straight into their Buffer. When the
+   deadline passes halfway through one, what arrived is parked in a per-fd
+   side table, checked against the owning socket like tcpopt, and the next
+   recv picks the body up where it stopped. */
+
+#define FRAME_U32 0
+#define FRAME_VARINT 1
+#define FRAME_HDRMAX 5
+#define FRAME_MAXLEN (64 * 1024 * 1024)
+
+static int frame_mode(Local<Value> v) {
+  if (v->IsString()) {
+    utf8 mode(v);
+    if (strcmp(*mode, "varint") == 0)
+      return FRAME_VARINT;
+  }
+  return FRAME_U32;
+}
+
+static size_t frame_encode(int mode, size_t len, unsigned char *hdr) {
+  if (mode == FRAME_U32) {
+    hdr[0] = len >> 24;
+    hdr[1] = len >> 16;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    return 4;
+  }
+  size_t n = 0;
+  do {
+    hdr[n] = len & 0x7f;
+    len >>= 7;
+    if (len)
+      hdr[n] |= 0x80;
+    n++;
+  } while (len);
+  return n;
+}
+
+/* Parses the header at p. Returns its size, 0 while more bytes are needed,
+   -1 on an oversized or malformed length. */
+static int frame_decode(int mode, const unsigned char *p, size_t avail,
+  size_t *len) {
+  if (mode == FRAME_U32) {
+    if (avail < 4)
+      return 0;
+    *len = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+    return *len > FRAME_MAXLEN ? -1 : 4;
+  }
+  *len = 0;
+  for (size_t i = 0; i < FRAME_HDRMAX; i++) {
+    if (i == avail)
+      return 0;
+    *len |= (size_t)(p[i] & 0x7f) << (7 * i);
+    if (!(p[i] & 0x80))
+      return *len > FRAME_MAXLEN ? -1 : i + 1;
+  }
+  return -1;
+}
+
+struct frame_part {
+  void *sock;
+  char *body;   /* pool_alloc memory */
+  size_t len;
+  size_t got;
+  int senderr;  /* a send stopped mid-frame, every later send fails */
+};
+
+static struct frame_part *frame_parts;
+static size_t frame_parts_len;
+
+static struct frame_part *frame_part(struct stream *st) {
+  size_t fd = st->fd;
+  if (fd >= frame_parts_len) {
+    size_t len = fd * 2 + 64;
+    frame_parts = (struct frame_part *)realloc(frame_parts,
+      len * sizeof(struct frame_part));
+    assert(frame_parts);
+    memset(frame_parts + frame_parts_len, 0,
+      (len - frame_parts_len) * sizeof(struct frame_part));
+    frame_parts_len = len;
+  }
+  struct frame_part *p = &frame_parts[fd];
+  if (p->sock != st->sock) {
+    /* left over from a socket that reused the fd without a close */
+    pool_discard(p->body);
+    memset(p, 0, sizeof *p);
+  }
+  return p;
+}
+
+/* done with the parked body, the socket's send state stays */
+static void frame_part_clear(struct frame_part *p) {
+  p->body = NULL;
+  p->len = 0;
+  p->got = 0;
+}
+
+static void frame_close(void *s, int fd) {
+  if ((size_t)fd >= frame_parts_len || frame_parts[fd].sock != s)
+    return;
+  pool_discard(frame_parts[fd].body);
+  memset(&frame_parts[fd], 0, sizeof(struct frame_part));
+}
+
+/* Reads the rest of p's body. A deadline keeps it parked for the next call,
+   any other error drops it along with the stream. Returns 0 once the body
+   is complete, -1 with errno set. */
+static int frame_body(struct stream *st, struct frame_part *p,
+  int64_t deadline) {
+  p->got += stream_read(st, p->body + p->got, p->len - p->got, deadline);
+  if (p->got == p->len)
+    return 0;
+  if (errno != ETIMEDOUT) {
+    int err = errno;
+    pool_discard(p->body);
+    frame_part_clear(p);
+    errno = err;
+  }
+  return -1;
+}
+
+/* Throws unless bufs is a Buffer, or an array of them, of at most
+   FRAME_MAXLEN bytes each: the peer would refuse a longer frame, and u32
+   headers can't even carry 4GB. */
+static bool frame_check(Local<Value> bufs) {
+  if (!stream_checkbufs(bufs))
+    return false;
+
+  uint32_t n = 1;
+  Local<Array> arr;
+  if (bufs->IsArray()) {
+    arr = bufs.As<Array>();
+    n = arr->Length();
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> b = bufs->IsArray() ? Nan::Get(arr, i).ToLocalChecked() : bufs;
+    if (node::Buffer::Length(b) > FRAME_MAXLEN) {
+      Nan::ThrowRangeError("frame longer than 64MB");
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Sends one Buffer or an array of them as frames, checked by frame_check.
+   Like tcpsend, frames that fit stay in obuf until the next flush; otherwise
+   obuf, headers and bodies go out together. A deadline between frames
+   leaves the stream usable; one that leaves a frame half sent would put the
+   peer out of step, so that send error sticks to every later send, like a
+   failed secure session. Returns the payload bytes sent, -1 with errno set. */
+static ssize_t frame_send(struct stream *st, Local<Value> bufs, int mode,
+  int64_t deadline) {
+  struct frame_part *p = frame_part(st);
+  if (p->senderr) {
+    errno = p->senderr;
+    return -1;
+  }
+
+  uint32_t n = 1;
+  Local<Array> arr;
+  if (bufs->IsArray()) {
+    arr = bufs.As<Array>();
+    n = arr->Length();
+  }
+
+  unsigned char *hdrs = (unsigned char *)malloc(n * FRAME_HDRMAX);
+  struct iovec *iov = (struct iovec *)malloc(2 * n * sizeof(struct iovec));
+  assert(hdrs && iov);
+
+  size_t payload = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> b = bufs->IsArray() ? Nan::Get(arr, i).ToLocalChecked() : bufs;
+    size_t len = node::Buffer::Length(b);
+    iov[2 * i].iov_base = hdrs + i * FRAME_HDRMAX;
+    iov[2 * i].iov_len = frame_encode(mode, len, hdrs + i * FRAME_HDRMAX);
+    iov[2 * i + 1].iov_base = node::Buffer::Data(b);
+    iov[2 * i + 1].iov_len = len;
+    payload += len;
+  }
+
+  size_t sent = stream_sendv(st, iov, 2 * n, deadline);
+  int err = errno;
+
+  if (err) {
+    /* iov is consumed by now, the frame edges come from the Buffers */
+    size_t edge = 0;
+    for (uint32_t i = 0; i < n && edge < sent; i++) {
+      Local<Value> b = bufs->IsArray() ? Nan::Get(arr, i).ToLocalChecked() : bufs;
+      size_t len = node::Buffer::Length(b);
+      edge += frame_encode(mode, len, hdrs) + len;
+    }
+    if (edge != sent) {
+      p->sock = st->sock;
+      p->senderr = err;
+    }
+  }
+
+  free(hdrs);
+  free(iov);
+  errno = err;
+  return err ? -1 : (ssize_t)payload;
+}
+
+/* Collects up to max frames. Blocks (up to the deadline) only until the
+   first frame is complete, after that it takes just what ibuf already holds.
+   Returns 0, or -1 with errno set and no frames returned. */
+static int frame_recv(struct stream *st, uint32_t max, int mode,
+  int64_t deadline, Local<Array> frames) {
+  uint32_t n = 0;
+  if (!max)
+    return 0;
+
+  /* finish the body a deadline interrupted last time */
+  struct frame_part *p = frame_part(st);
+  if (p->body) {
+    if (frame_body(st, p, deadline))
+      return -1;
+    Set(frames, n++, pool_buffer(p->body, p->len));
+    frame_part_clear(p);
+  }
+
+  while (n < max) {
+    size_t len;
+    int hsz = frame_decode(mode,
+      (unsigned char *)st->ibuf + *st->ifirst, *st->ilen, &len);
+    if (hsz < 0) {
+      errno = EPROTO;
+      return n ? 0 : -1;
+    }
+
+    /* header incomplete */
+    if (hsz == 0) {
+      if (n || stream_fill(st, deadline))
+        return n ? 0 : -1;
+      continue;
+    }
+
+    /* body incomplete, only wait for it when there is nothing to return.
+       A frame that fits waits in ibuf, where a deadline leaves it whole */
+    if (*st->ilen - hsz < len) {
+      if (n)
+        return 0;
+      if (hsz + len <= st->buflen) {
+        if (stream_fill(st, deadline))
+          return -1;
+        continue;
+      }
+    }
+
+    *st->ifirst += hsz;
+    *st->ilen -= hsz;
+    p->sock = st->sock;
+    p->body = pool_alloc(len);
+    p->len = len;
+    p->got = 0;
+    if (frame_body(st, p, deadline))
+      return -1;
+    Set(frames, n++, pool_buffer(p->body, len));
+    frame_part_clear(p);
+  }
+  return 0;
+}
+
+/* a frames call counts as one recv of all the payload it returned */
+static void frame_stat(double *stat, Local<Array> frames) {
+  size_t sz = 0;
+  for (uint32_t i = 0; i < frames->Length(); i++)
+    sz += node::Buffer::Length(Nan::Get(frames, i).ToLocalChecked());
+  iostat_recv(stat, sz, frames->Length() == 0);
+}
+
+//api: tcpsendframe(s, buf | [bufs], 'u32' | 'varint', deadline)
+NAN_METHOD(tcpsendframe){
+  MILL_GUARD("tcpsendframe");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[3]->IsNumber())
+    deadline = now() + To<int64_t>(info[3]).FromJust();
+
+  if (!frame_check(info[1]))
+    return;
+
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  ssize_t sz = frame_send(&st, info[1], frame_mode(info[2]), deadline);
+  if (sz < 0)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcpsendframe"));
+  iostat_send(st.stat, sz);
+  ret(New<Number>(sz));
+}
+
+//api: tcprecvframes(s, max, 'u32' | 'varint', deadline), [] on deadline
+NAN_METHOD(tcprecvframes){
+  MILL_GUARD("tcprecvframes");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[3]->IsNumber())
+    deadline = now() + To<int64_t>(info[3]).FromJust();
+
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  Local<Array> frames = New<Array>();
+  if (frame_recv(&st, To<uint32_t>(info[1]).FromJust(), frame_mode(info[2]),
+      deadline, frames) && errno != ETIMEDOUT)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "tcprecvframes"));
+  frame_stat(st.stat, frames);
+  ret(frames);
+}
+
+//api: unixsendframe(s, buf | [bufs], 'u32' | 'varint', deadline)
+NAN_METHOD(unixsendframe){
+  MILL_GUARD("unixsendframe");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[3]->IsNumber())
+    deadline = now() + To<int64_t>(info[3]).FromJust();
+
+  if (!frame_check(info[1]))
+    return;
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  ssize_t sz = frame_send(&st, info[1], frame_mode(info[2]), deadline);
+  if (sz < 0)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "unixsendframe"));
+  iostat_send(st.stat, sz);
+  ret(New<Number>(sz));
+}
+
+//api: unixrecvframes(s, max, 'u32' | 'varint', deadline), [] on deadline
+NAN_METHOD(unixrecvframes){
+  MILL_GUARD("unixrecvframes");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[3]->IsNumber())
+    deadline = now() + To<int64_t>(info[3]).FromJust();
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  Local<Array> frames = New<Array>();
+  if (frame_recv(&st, To<uint32_t>(info[1]).FromJust(), frame_mode(info[2]),
+      deadline, frames) && errno != ETIMEDOUT)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "unixrecvframes"));
+  frame_stat(st.stat, frames);
+  ret(frames);
+}
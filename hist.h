@@ -0,0 +1,120 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Latency histograms                                                        */
+/******************************************************************************/
+
+/* Time spent inside the blocking calls, in log-linear buckets: values below
+   HIST_SUB ns get a bucket each, above that every power of two is split
+   into HIST_SUB equal buckets, so a bucket is never off by more than 1/16th.
+   Timing uses uv_hrtime(), libmill's now() only has ms resolution. Sampling
+   is off until histsample() turns it on, an unsampled call costs a counter
+   increment. */
+
+#define HIST_SUBBITS 4
+#define HIST_SUB (1 << HIST_SUBBITS)
+#define HIST_GROUPS 40  /* up to 2^43 ns, a bit over two hours */
+#define HIST_BUCKETS (HIST_GROUPS * HIST_SUB)
+
+enum {
+  HIST_TCPRECV,   /* tcprecv and the recvuntil/recvinto variants */
+  HIST_TCPFLUSH,
+  HIST_TCPACCEPT,
+  HIST_UDPRECV,
+  HIST_SENDSTR,   /* tcpsendstr, seal and send */
+  HIST_RECVSECRET,/* tcprecvsecret, recv and open */
+  HIST_BOXSEAL,   /* box_seal, call to callback, pool queueing included */
+  HIST_BOXOPEN,
+  HIST_SECURESEND,
+  HIST_SECURERECV,
+  HIST_N
+};
+
+static const char *hist_names[HIST_N] = {
+  "tcprecv", "tcpflush", "tcpaccept", "udprecv", "tcpsendstr", "tcprecvsecret",
+  "box_seal", "box_open", "securesend", "securerecv"
+};
+
+static struct {
+  uint32_t every; /* record 1 in every calls, 0 records none */
+  uint32_t tick;
+  double counts[HIST_N][HIST_BUCKETS];
+} hist;
+
+static int hist_bucket(uint64_t ns) {
+  if (ns < HIST_SUB)
+    return ns;
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - HIST_SUBBITS;
+  int b = (shift + 1) * HIST_SUB + (int)((ns >> shift) - HIST_SUB);
+  return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/* lowest value in ns that lands in bucket b */
+static double hist_lower(int b) {
+  if (b < HIST_SUB)
+    return b;
+  int shift = b / HIST_SUB - 1;
+  return (double)(HIST_SUB + b % HIST_SUB) * ((uint64_t)1 << shift);
+}
+
+/* a start time when this call is sampled, 0 when it is not */
+static inline uint64_t hist_start() {
+  if (!hist.every || ++hist.tick < hist.every)
+    return 0;
+  hist.tick = 0;
+  return uv_hrtime();
+}
+
+static inline void hist_record(int op, uint64_t t0) {
+  if (t0)
+    hist.counts[op][hist_bucket(uv_hrtime() - t0)]++;
+}
+
+//api: histsample(every), 1 records every call, n 1 in n, 0 stops recording
+NAN_METHOD(histsample){
+  hist.every = To<uint32_t>(info[0]).FromJust();
+  hist.tick = 0;
+}
+
+/* Counts since the last snapshot as one Float64Array, HIST_BUCKETS per
+   call in histnames order, then starts over. */
+NAN_METHOD(histograms){
+  Local<ArrayBuffer> ab = ArrayBuffer::New(Isolate::GetCurrent(),
+    sizeof(hist.counts));
+  memcpy(ab->GetContents().Data(), hist.counts, sizeof(hist.counts));
+  memset(hist.counts, 0, sizeof(hist.counts));
+  ret(Float64Array::New(ab, 0, HIST_N * HIST_BUCKETS));
+}
+
+/* the lower bound in ns of every bucket, the same for every call */
+NAN_METHOD(histbounds){
+  Local<ArrayBuffer> ab = ArrayBuffer::New(Isolate::GetCurrent(),
+    HIST_BUCKETS * sizeof(double));
+  double *b = (double *)ab->GetContents().Data();
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    b[i] = hist_lower(i);
+  ret(Float64Array::New(ab, 0, HIST_BUCKETS));
+}
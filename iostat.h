@@ -0,0 +1,158 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  I/O counters                                                              */
+/******************************************************************************/
+
+/* Counters for every tcp, udp and unix socket, plus process-wide totals.
+   libmill's connection structs are fixed, so like tcpopt they live in a side
+   table indexed by fd and checked against the owning socket. Entries are
+   allocated once per fd and never move, streams and async contexts keep a
+   pointer to theirs.
+
+   Calls and bytes are counted at the js boundary. Syscalls and EAGAINs are
+   counted where the binding does its own I/O: unbuffered, vectored, framed,
+   async, batched udp and zero-copy paths. Syscalls libmill makes inside
+   tcprecv/tcpsend/... are not visible from here. */
+
+enum {
+  IOSTAT_BYTESIN,
+  IOSTAT_BYTESOUT,
+  IOSTAT_RECVS,    /* recv calls */
+  IOSTAT_SENDS,    /* send calls */
+  IOSTAT_FLUSHES,
+  IOSTAT_SYSCALLS,
+  IOSTAT_EAGAIN,
+  IOSTAT_PARTIAL,  /* recvs cut short by a deadline, reset or error */
+  IOSTAT_N
+};
+
+static const char *iostat_names[IOSTAT_N] = {
+  "bytesin", "bytesout", "recvs", "sends", "flushes", "syscalls", "eagain",
+  "partial"
+};
+
+struct iostat {
+  const void *sock;
+  double c[IOSTAT_N];
+};
+
+static struct iostat **iostat_tab;
+static size_t iostat_len;
+static double iostat_total[IOSTAT_N];
+
+/* the counters of sock, zeroed when fd last belonged to another socket */
+static double *iostat(const void *sock, int fd) {
+  if ((size_t)fd >= iostat_len) {
+    size_t len = fd * 2 + 64;
+    iostat_tab = (struct iostat **)realloc(iostat_tab,
+      len * sizeof(struct iostat *));
+    assert(iostat_tab);
+    memset(iostat_tab + iostat_len, 0,
+      (len - iostat_len) * sizeof(struct iostat *));
+    iostat_len = len;
+  }
+
+  struct iostat *e = iostat_tab[fd];
+  if (!e) {
+    e = (struct iostat *)malloc(sizeof(struct iostat));
+    assert(e);
+    iostat_tab[fd] = e;
+  } else if (e->sock == sock) {
+    return e->c;
+  }
+  memset(e, 0, sizeof(struct iostat));
+  e->sock = sock;
+  return e->c;
+}
+
+static void iostat_close(const void *sock, int fd) {
+  if ((size_t)fd < iostat_len && iostat_tab[fd] &&
+      iostat_tab[fd]->sock == sock)
+    iostat_tab[fd]->sock = NULL;
+}
+
+static inline void iostat_add(double *c, int i, double n) {
+  c[i] += n;
+  iostat_total[i] += n;
+}
+
+static inline void iostat_recv(double *c, size_t got, int partial) {
+  iostat_add(c, IOSTAT_RECVS, 1);
+  iostat_add(c, IOSTAT_BYTESIN, got);
+  if (partial)
+    iostat_add(c, IOSTAT_PARTIAL, 1);
+}
+
+static inline void iostat_send(double *c, size_t sz) {
+  iostat_add(c, IOSTAT_SENDS, 1);
+  iostat_add(c, IOSTAT_BYTESOUT, sz);
+}
+
+/* one syscall that returned rc, EAGAINs counted apart */
+static inline void iostat_syscall(double *c, ssize_t rc) {
+  iostat_add(c, IOSTAT_SYSCALLS, 1);
+  if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    iostat_add(c, IOSTAT_EAGAIN, 1);
+}
+
+static Local<Value> iostat_array(const double *c) {
+  Local<ArrayBuffer> ab = ArrayBuffer::New(Isolate::GetCurrent(),
+    IOSTAT_N * sizeof(double));
+  memcpy(ab->GetContents().Data(), c, IOSTAT_N * sizeof(double));
+  return Float64Array::New(ab, 0, IOSTAT_N);
+}
+
+/* Counters of any tcp, udp or unix socket as a Float64Array, indexed like
+   statnames. All zero for a socket that has not done any I/O yet.
+
+   The entry is found by fd, like iostat() does. The caller doesn't say
+   which kind of socket it passed, so the fd is read at both places the
+   mirrored libmill structs keep it: after the type in tcp and unix socks
+   (asserted here and next to the unix structs), first in udp socks. The
+   stored sock decides, so the wrong guess only misses. */
+static_assert(offsetof(struct mill_tcplistener, fd) ==
+  offsetof(struct mill_tcpconn, fd), "tcp listener fd moved");
+static_assert(offsetof(struct mill_udpsock, fd) == 0, "udp fd moved");
+
+//api: stats(s)
+NAN_METHOD(stats){
+  const void *sock = UnwrapPointer<void *>(info[0]);
+  static const double zero[IOSTAT_N] = { 0 };
+  if (sock) {
+    int fds[2] = { ((const struct mill_tcpconn *)sock)->fd,
+      ((const struct mill_udpsock *)sock)->fd };
+    for (int i = 0; i < 2; i++)
+      if (fds[i] >= 0 && (size_t)fds[i] < iostat_len && iostat_tab[fds[i]] &&
+          iostat_tab[fds[i]]->sock == sock)
+        return ret(iostat_array(iostat_tab[fds[i]]->c));
+  }
+  ret(iostat_array(zero));
+}
+
+/* totals over every socket since the process started, closed ones too */
+NAN_METHOD(globalstats){
+  ret(iostat_array(iostat_total));
+}
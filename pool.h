@@ -0,0 +1,215 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Receive buffer pool                                                       */
+/******************************************************************************/
+
+/* Receive paths get their memory from fixed-size chunks carved out of slabs.
+   A chunk is handed to JS as a Buffer over the chunk itself and goes back on
+   the freelist when that Buffer is collected, or earlier on release(). Reads
+   larger than a chunk, or made while every slab is in use, fall back to the
+   heap. */
+
+#define POOL_CHUNKSZ 16384
+#define POOL_SLABCHUNKS 64
+#define POOL_MAXSLABS 64
+
+struct pool_chunk {
+  struct pool_chunk *next;
+  uint32_t gen;  /* bumped on every hand-out, tells stale free cbs apart */
+  uint8_t out;   /* currently owned by a Buffer */
+  uint8_t heap;  /* fallback allocation, not part of a slab */
+};
+
+struct pool_slab {
+  struct pool_slab *next;
+  char *mem;
+};
+
+static struct {
+  size_t chunksz;
+  size_t slabchunks;
+  size_t maxslabs;
+  size_t nslabs;
+  struct pool_slab *slabs;
+  struct pool_chunk *free;
+
+  /* statistics */
+  double hits;
+  double misses;
+  double fallbacks;
+  double inuse;
+} rpool = { POOL_CHUNKSZ, POOL_SLABCHUNKS, POOL_MAXSLABS };
+
+#define POOL_HDR (sizeof(struct pool_chunk))
+#define POOL_DATA(c) ((char *)(c) + POOL_HDR)
+#define POOL_CHUNK(d) ((struct pool_chunk *)((char *)(d) - POOL_HDR))
+
+static int pool_grow() {
+  if (rpool.nslabs >= rpool.maxslabs)
+    return 0;
+
+  size_t stride = POOL_HDR + rpool.chunksz;
+  struct pool_slab *slab = (struct pool_slab *)malloc(sizeof *slab);
+  if (!slab)
+    return 0;
+  slab->mem = (char *)malloc(stride * rpool.slabchunks);
+  if (!slab->mem) {
+    free(slab);
+    return 0;
+  }
+  slab->next = rpool.slabs;
+  rpool.slabs = slab;
+  rpool.nslabs++;
+
+  for (size_t i = 0; i < rpool.slabchunks; i++) {
+    struct pool_chunk *c = (struct pool_chunk *)(slab->mem + i * stride);
+    c->gen = 0;
+    c->out = 0;
+    c->heap = 0;
+    c->next = rpool.free;
+    rpool.free = c;
+  }
+  return 1;
+}
+
+/* true when d is the data of a slab chunk */
+static int pool_owns(const char *d) {
+  size_t stride = POOL_HDR + rpool.chunksz;
+  for (struct pool_slab *s = rpool.slabs; s; s = s->next) {
+    if (d >= s->mem && d < s->mem + stride * rpool.slabchunks)
+      return (size_t)(d - s->mem) % stride == POOL_HDR;
+  }
+  return 0;
+}
+
+static void pool_put(struct pool_chunk *c) {
+  if (c->heap) {
+    free(c);
+    return;
+  }
+  c->out = 0;
+  c->next = rpool.free;
+  rpool.free = c;
+  rpool.inuse--;
+}
+
+/* memory for a receive of up to len bytes. hits are served from a resident
+   chunk, misses had to grow the pool or fall back to the heap */
+static char *pool_alloc(size_t len) {
+  struct pool_chunk *c;
+
+  if (len <= rpool.chunksz) {
+    if (rpool.free)
+      rpool.hits++;
+    else if (pool_grow())
+      rpool.misses++;
+
+    if ((c = rpool.free)) {
+      rpool.free = c->next;
+      c->gen++;
+      c->out = 1;
+      rpool.inuse++;
+      return POOL_DATA(c);
+    }
+  }
+
+  c = (struct pool_chunk *)malloc(POOL_HDR + (len ? len : 1));
+  assert(c);
+  c->gen = 0;
+  c->out = 1;
+  c->heap = 1;
+  rpool.misses++;
+  rpool.fallbacks++;
+  return POOL_DATA(c);
+}
+
+/* give back pool_alloc memory that never reached JS */
+static void pool_discard(char *d) {
+  if (d)
+    pool_put(POOL_CHUNK(d));
+}
+
+static void pool_free_cb(char *d, void *hint) {
+  struct pool_chunk *c = POOL_CHUNK(d);
+
+  /* already back on the freelist through release() */
+  if (!c->heap && (!c->out || c->gen != (uint32_t)(uintptr_t)hint))
+    return;
+  pool_put(c);
+}
+
+/* hands pool_alloc memory to JS as a Buffer of sz bytes */
+static Local<Object> pool_buffer(char *d, size_t sz) {
+  struct pool_chunk *c = POOL_CHUNK(d);
+  return NewBuffer(d, sz, pool_free_cb, (void *)(uintptr_t)c->gen)
+    .ToLocalChecked();
+}
+
+//api: pool(chunksz, slabchunks, maxslabs), before the first pooled recv
+NAN_METHOD(pool){
+  if (rpool.nslabs)
+    return Nan::ThrowError("pool already in use, configure it first");
+
+  if (info[0]->IsNumber())
+    rpool.chunksz = (To<uint32_t>(info[0]).FromJust() + 7) & ~(size_t)7;
+  if (info[1]->IsNumber())
+    rpool.slabchunks = To<uint32_t>(info[1]).FromJust();
+  if (info[2]->IsNumber())
+    rpool.maxslabs = To<uint32_t>(info[2]).FromJust();
+
+  if (!rpool.chunksz || !rpool.slabchunks)
+    return Nan::ThrowRangeError("pool chunks and slabs must not be empty");
+}
+
+/* Returns a pooled Buffer's chunk right away instead of waiting for the GC.
+   The Buffer, and any slice of it, must not be touched afterwards. */
+NAN_METHOD(release){
+  if (!node::Buffer::HasInstance(info[0]))
+    return;
+
+  char *d = node::Buffer::Data(info[0]);
+  if (!pool_owns(d))
+    return;
+
+  struct pool_chunk *c = POOL_CHUNK(d);
+  if (c->out)
+    pool_put(c);
+}
+
+NAN_METHOD(poolstats){
+  Local<Object> o = New<Object>();
+  double resident = (double)rpool.nslabs * rpool.slabchunks *
+    (POOL_HDR + rpool.chunksz);
+
+  Set(o, New("hits").ToLocalChecked(), New<Number>(rpool.hits));
+  Set(o, New("misses").ToLocalChecked(), New<Number>(rpool.misses));
+  Set(o, New("fallbacks").ToLocalChecked(), New<Number>(rpool.fallbacks));
+  Set(o, New("inuse").ToLocalChecked(), New<Number>(rpool.inuse));
+  Set(o, New("slabs").ToLocalChecked(), New<Number>(rpool.nslabs));
+  Set(o, New("resident").ToLocalChecked(), New<Number>(resident));
+
+  ret(o);
+}
@@ -0,0 +1,514 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Encrypted streams                                                         */
+/******************************************************************************/
+
+/* A crypto_kx key exchange followed by a crypto_secretstream in each
+   direction, carried in u32 frames. Messages of any size are split into
+   chunks; every chunk is one frame, the last one of a message is tagged
+   PUSH. Chunks that fit are sealed straight into obuf, complete frames are
+   opened straight out of ibuf.
+
+   A chunk that fits in ibuf is only taken once it is all there, a larger
+   one is read into cbuf and resumed there after a deadline, so timeouts
+   never put the secretstream out of step with the wire. Anything that does
+   (a failed authentication, a chunk cut short by an error, a send cut off
+   after its chunk was sealed) fails the session for good. */
+
+#ifdef crypto_secretstream_xchacha20poly1305_ABYTES
+
+#define SECURE_ABYTES crypto_secretstream_xchacha20poly1305_ABYTES
+#define SECURE_CHUNK (64 * 1024)
+
+typedef crypto_secretstream_xchacha20poly1305_state secure_state;
+
+struct secure {
+  void *sock;  /* the stream view is rebuilt on every call, see secure_view */
+  int isunix;
+  secure_state tx;
+  secure_state rx;
+  int err;     /* once set, every call throws it */
+
+  /* ciphertext of chunks that do not fit obuf or are not buffered yet */
+  unsigned char *cbuf;
+  size_t cbufsz;
+  size_t clen; /* chunk being read into cbuf, 0 when none */
+  size_t cgot;
+
+  /* message being put back together from its chunks */
+  char *msg;
+  size_t msglen;
+  size_t msgsz;
+  size_t maxmsg; /* longer messages fail the session with EMSGSIZE */
+};
+
+/* the connection's current view, tcpopts() changes show up right away */
+static void secure_view(struct secure *ss, struct stream *st) {
+  if (ss->isunix)
+    stream_unix((unixsock)ss->sock, st);
+  else
+    stream_tcp((tcpsock)ss->sock, st);
+}
+
+static int secure_fail(struct secure *ss, int err) {
+  ss->err = err;
+  errno = err;
+  return -1;
+}
+
+static int secure_reserve(void *buf, size_t *sz, size_t len) {
+  void **p = (void **)buf;
+  if (len <= *sz)
+    return 0;
+  void *n = realloc(*p, len);
+  if (!n) {
+    errno = ENOMEM;
+    return -1;
+  }
+  *p = n;
+  *sz = len;
+  return 0;
+}
+
+/* one plaintext frame, written through along with whatever obuf holds */
+static int secure_sendraw(struct stream *st, const unsigned char *data,
+  size_t len, int64_t deadline) {
+  unsigned char hdr[FRAME_HDRMAX];
+  struct iovec iov[2];
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = frame_encode(FRAME_U32, len, hdr);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+  return stream_writev(st, iov, 2, deadline);
+}
+
+/* one plaintext frame of exactly len bytes */
+static int secure_recvraw(struct stream *st, unsigned char *data, size_t len,
+  int64_t deadline) {
+  size_t flen;
+  int hsz;
+  while (!(hsz = frame_decode(FRAME_U32,
+      (unsigned char *)st->ibuf + *st->ifirst, *st->ilen, &flen)))
+    if (stream_fill(st, deadline))
+      return -1;
+  if (hsz < 0 || flen != len) {
+    errno = EPROTO;
+    return -1;
+  }
+  *st->ifirst += hsz;
+  *st->ilen -= hsz;
+  return stream_read(st, (char *)data, len, deadline) < len ? -1 : 0;
+}
+
+/* Swaps kx public keys, derives the session keys and swaps the stream
+   headers. peer, when given, is the only public key accepted. */
+static int secure_handshake(struct secure *ss, struct stream *st, int server,
+  const unsigned char *pk, const unsigned char *sk, const unsigned char *peer,
+  int64_t deadline) {
+  unsigned char theirs[crypto_kx_PUBLICKEYBYTES];
+  unsigned char rxk[crypto_kx_SESSIONKEYBYTES];
+  unsigned char txk[crypto_kx_SESSIONKEYBYTES];
+  unsigned char hdr[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+  int rc = -1;
+
+  if (secure_sendraw(st, pk, crypto_kx_PUBLICKEYBYTES, deadline) ||
+      secure_recvraw(st, theirs, sizeof theirs, deadline))
+    return -1;
+  if (peer && sodium_memcmp(peer, theirs, sizeof theirs)) {
+    errno = EACCES;
+    return -1;
+  }
+
+  if (server)
+    rc = crypto_kx_server_session_keys(rxk, txk, pk, sk, theirs);
+  else
+    rc = crypto_kx_client_session_keys(rxk, txk, pk, sk, theirs);
+  if (rc) {
+    errno = EACCES;
+    return -1;
+  }
+  rc = -1;
+
+  crypto_secretstream_xchacha20poly1305_init_push(&ss->tx, hdr, txk);
+  if (secure_sendraw(st, hdr, sizeof hdr, deadline) ||
+      secure_recvraw(st, hdr, sizeof hdr, deadline))
+    goto out;
+  if (crypto_secretstream_xchacha20poly1305_init_pull(&ss->rx, hdr, rxk)) {
+    errno = EPROTO;
+    goto out;
+  }
+  rc = 0;
+
+out:
+  sodium_memzero(rxk, sizeof rxk);
+  sodium_memzero(txk, sizeof txk);
+  return rc;
+}
+
+static int secure_sendchunk(struct secure *ss, struct stream *st,
+  const unsigned char *m, size_t mlen, unsigned char tag, int64_t deadline) {
+  size_t clen = mlen + SECURE_ABYTES;
+  unsigned char hdr[FRAME_HDRMAX];
+  size_t hsz = frame_encode(FRAME_U32, clen, hdr);
+
+  if (!st->unbuffered && hsz + clen <= st->buflen - *st->olen) {
+    unsigned char *p = (unsigned char *)st->obuf + *st->olen;
+    memcpy(p, hdr, hsz);
+    crypto_secretstream_xchacha20poly1305_push(&ss->tx, p + hsz, NULL,
+      m, mlen, NULL, 0, tag);
+    *st->olen += hsz + clen;
+    return 0;
+  }
+
+  if (secure_reserve(&ss->cbuf, &ss->cbufsz, clen))
+    return -1;
+  crypto_secretstream_xchacha20poly1305_push(&ss->tx, ss->cbuf, NULL,
+    m, mlen, NULL, 0, tag);
+
+  struct iovec iov[2];
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = hsz;
+  iov[1].iov_base = ss->cbuf;
+  iov[1].iov_len = clen;
+  if (stream_writev(st, iov, 2, deadline))
+    return secure_fail(ss, errno);
+  return 0;
+}
+
+static int secure_send(struct secure *ss, struct stream *st, const char *data,
+  size_t len, int64_t deadline) {
+  const unsigned char *m = (const unsigned char *)data;
+  do {
+    size_t n = len < SECURE_CHUNK ? len : SECURE_CHUNK;
+    unsigned char tag = n == len ?
+      crypto_secretstream_xchacha20poly1305_TAG_PUSH :
+      crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+    if (secure_sendchunk(ss, st, m, n, tag, deadline))
+      return -1;
+    m += n;
+    len -= n;
+  } while (len);
+  return 0;
+}
+
+/* Opens the next chunk. Returns 1 once it completes a message, which is
+   then in *out, 0 after a chunk that continues one, -1 with errno set.
+   Without wait only a chunk already complete in ibuf is taken, EAGAIN
+   otherwise. */
+static int secure_recvchunk(struct secure *ss, struct stream *st, int wait,
+  int64_t deadline, Local<Value> *out) {
+  size_t clen = ss->clen;
+  const unsigned char *c = ss->cbuf;
+  int buffered = 0;
+
+  if (!clen) {
+    int hsz;
+    for (;;) {
+      hsz = frame_decode(FRAME_U32,
+        (unsigned char *)st->ibuf + *st->ifirst, *st->ilen, &clen);
+      if (hsz < 0 || (hsz && clen < SECURE_ABYTES))
+        return secure_fail(ss, EPROTO);
+      if (hsz && *st->ilen - hsz >= clen)
+        break;
+
+      /* a larger chunk goes to cbuf, the rest wait whole in ibuf */
+      if (hsz && hsz + clen > st->buflen) {
+        if (!wait) {
+          errno = EAGAIN;
+          return -1;
+        }
+        if (secure_reserve(&ss->cbuf, &ss->cbufsz, clen))
+          return -1;
+        ss->clen = clen;
+        ss->cgot = 0;
+        c = ss->cbuf;
+        break;
+      }
+      if (!wait) {
+        errno = EAGAIN;
+        return -1;
+      }
+      if (stream_fill(st, deadline))
+        return -1;
+    }
+    *st->ifirst += hsz;
+    *st->ilen -= hsz;
+    buffered = !ss->clen;
+    if (buffered)
+      c = (unsigned char *)st->ibuf + *st->ifirst;
+  } else if (!wait) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (!buffered) {
+    ss->cgot += stream_read(st, (char *)ss->cbuf + ss->cgot,
+      clen - ss->cgot, deadline);
+    if (ss->cgot < clen)
+      return errno == ETIMEDOUT ? -1 : secure_fail(ss, errno);
+    ss->clen = 0;
+  }
+
+  size_t mlen = clen - SECURE_ABYTES;
+  char *m = pool_alloc(mlen);
+  unsigned char tag;
+  int bad = crypto_secretstream_xchacha20poly1305_pull(&ss->rx,
+    (unsigned char *)m, NULL, &tag, c, clen, NULL, 0);
+  if (buffered) {
+    *st->ifirst += clen;
+    *st->ilen -= clen;
+  }
+  if (bad) {
+    pool_discard(m);
+    return secure_fail(ss, EBADMSG);
+  }
+
+  /* the peer decides how many chunks a message takes, not our memory */
+  if (ss->msglen + mlen > ss->maxmsg) {
+    pool_discard(m);
+    return secure_fail(ss, EMSGSIZE);
+  }
+
+  int done = tag & crypto_secretstream_xchacha20poly1305_TAG_PUSH;
+
+  /* the common single chunk message is handed over as is */
+  if (done && !ss->msglen) {
+    *out = pool_buffer(m, mlen);
+    return 1;
+  }
+
+  if (secure_reserve(&ss->msg, &ss->msgsz, ss->msglen + mlen)) {
+    pool_discard(m);
+    return -1;
+  }
+  memcpy(ss->msg + ss->msglen, m, mlen);
+  ss->msglen += mlen;
+  pool_discard(m);
+  if (!done)
+    return 0;
+
+  *out = NewBuffer(ss->msg, ss->msglen).ToLocalChecked();
+  ss->msg = NULL;
+  ss->msglen = ss->msgsz = 0;
+  return 1;
+}
+
+static void secure_free(struct secure *ss) {
+  free(ss->cbuf);
+  free(ss->msg);
+  sodium_memzero(ss, sizeof(*ss));
+  free(ss);
+}
+
+/* Handshakes over st, returns the session or NULL after throwing */
+static struct secure *secure_start(struct stream *st, int isunix,
+  Local<Value> role, Local<Value> opts, Local<Value> dl, const char *name) {
+  unsigned char pk[crypto_kx_PUBLICKEYBYTES];
+  unsigned char sk[crypto_kx_SECRETKEYBYTES];
+  unsigned char peer[crypto_kx_PUBLICKEYBYTES];
+  int pinned = 0;
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (dl->IsNumber())
+    deadline = now() + To<int64_t>(dl).FromJust();
+
+  int server = 0;
+  if (role->IsString()) {
+    utf8 r(role);
+    server = strcmp(*r, "server") == 0;
+  }
+
+  /* a fresh keypair unless one is passed, the peer's key is optional */
+  crypto_kx_keypair(pk, sk);
+  size_t maxmsg = FRAME_MAXLEN;
+  if (opts->IsObject()) {
+    Local<Object> o = opts.As<Object>();
+    Local<Value> m = Nan::Get(o, New("maxmsg").ToLocalChecked()).ToLocalChecked();
+    if (m->IsNumber()) {
+      int64_t n = To<int64_t>(m).FromJust();
+      if (n < 0) {
+        Nan::ThrowRangeError("maxmsg must not be negative");
+        return NULL;
+      }
+      maxmsg = n;
+    }
+    Local<Value> p = Nan::Get(o, New("pk").ToLocalChecked()).ToLocalChecked();
+    Local<Value> s = Nan::Get(o, New("sk").ToLocalChecked()).ToLocalChecked();
+    Local<Value> r = Nan::Get(o, New("peer").ToLocalChecked()).ToLocalChecked();
+
+    if (node::Buffer::HasInstance(p) && node::Buffer::HasInstance(s)) {
+      if (node::Buffer::Length(p) != sizeof pk ||
+          node::Buffer::Length(s) != sizeof sk) {
+        Nan::ThrowRangeError("kx keys must be 32 bytes");
+        return NULL;
+      }
+      memcpy(pk, node::Buffer::Data(p), sizeof pk);
+      memcpy(sk, node::Buffer::Data(s), sizeof sk);
+    }
+    if (node::Buffer::HasInstance(r)) {
+      if (node::Buffer::Length(r) != sizeof peer) {
+        Nan::ThrowRangeError("kx keys must be 32 bytes");
+        return NULL;
+      }
+      memcpy(peer, node::Buffer::Data(r), sizeof peer);
+      pinned = 1;
+    }
+  }
+
+  struct secure *ss = (struct secure *)calloc(1, sizeof(struct secure));
+  assert(ss);
+  ss->sock = st->sock;
+  ss->isunix = isunix;
+  ss->maxmsg = maxmsg;
+
+  int rc = secure_handshake(ss, st, server, pk, sk, pinned ? peer : NULL,
+    deadline);
+  sodium_memzero(sk, sizeof sk);
+  if (rc) {
+    int err = errno;
+    secure_free(ss);
+    Nan::ThrowError(Nan::ErrnoException(err, name));
+    return NULL;
+  }
+  return ss;
+}
+
+//api: kx_keypair(), { pk, sk } Buffers for a long-lived identity
+NAN_METHOD(kx_keypair){
+  Local<Object> pk = NewBuffer(crypto_kx_PUBLICKEYBYTES).ToLocalChecked();
+  Local<Object> sk = NewBuffer(crypto_kx_SECRETKEYBYTES).ToLocalChecked();
+  crypto_kx_keypair((unsigned char *)node::Buffer::Data(pk),
+    (unsigned char *)node::Buffer::Data(sk));
+
+  Local<Object> o = New<Object>();
+  Set(o, New("pk").ToLocalChecked(), pk);
+  Set(o, New("sk").ToLocalChecked(), sk);
+  ret(o);
+}
+
+//api: tcpsecure(s, 'client' | 'server', { pk, sk, peer, maxmsg }, deadline)
+NAN_METHOD(tcpsecure){
+  MILL_GUARD("tcpsecure");
+  struct stream st;
+  stream_tcp(UnwrapPointer<tcpsock>(info[0]), &st);
+  struct secure *ss = secure_start(&st, 0, info[1], info[2], info[3],
+    "tcpsecure");
+  if (ss)
+    ret(WrapPointer(ss, sizeof(struct secure *)));
+}
+
+//api: unixsecure(s, 'client' | 'server', { pk, sk, peer, maxmsg }, deadline)
+NAN_METHOD(unixsecure){
+  MILL_GUARD("unixsecure");
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  struct secure *ss = secure_start(&st, 1, info[1], info[2], info[3],
+    "unixsecure");
+  if (ss)
+    ret(WrapPointer(ss, sizeof(struct secure *)));
+}
+
+/* like tcpsend, what fits stays in obuf until the connection is flushed */
+//api: securesend(ss, buf | [bufs], deadline)
+NAN_METHOD(securesend){
+  MILL_GUARD("securesend");
+  struct secure *ss = UnwrapPointer<struct secure *>(info[0]);
+  if (ss->err)
+    return Nan::ThrowError(Nan::ErrnoException(ss->err, "securesend"));
+  struct stream st;
+  secure_view(ss, &st);
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  uint32_t n = 1;
+  Local<Array> arr;
+  if (info[1]->IsArray()) {
+    arr = info[1].As<Array>();
+    n = arr->Length();
+  }
+
+  uint64_t t0 = hist_start();
+  size_t sz = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> b = info[1]->IsArray() ?
+      Nan::Get(arr, i).ToLocalChecked() : info[1];
+    if (secure_send(ss, &st, node::Buffer::Data(b), node::Buffer::Length(b),
+        deadline))
+      return Nan::ThrowError(Nan::ErrnoException(errno, "securesend"));
+    sz += node::Buffer::Length(b);
+  }
+  hist_record(HIST_SECURESEND, t0);
+  ret(New<Number>(sz));
+}
+
+/* Like tcprecvframes: waits (up to the deadline) for the first message,
+   then takes what is already buffered, up to max. [] on deadline. A failed
+   authentication throws EBADMSG, the session is unusable after that. When
+   it fails behind messages already opened, those are returned and the next
+   call throws. */
+//api: securerecv(ss, max, deadline)
+NAN_METHOD(securerecv){
+  MILL_GUARD("securerecv");
+  struct secure *ss = UnwrapPointer<struct secure *>(info[0]);
+  uint32_t max = To<uint32_t>(info[1]).FromJust();
+  if (ss->err)
+    return Nan::ThrowError(Nan::ErrnoException(ss->err, "securerecv"));
+  struct stream st;
+  secure_view(ss, &st);
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  uint64_t t0 = hist_start();
+  Local<Array> msgs = New<Array>();
+  uint32_t n = 0;
+  while (n < max) {
+    Local<Value> m;
+    int rc = secure_recvchunk(ss, &st, n == 0, deadline, &m);
+    if (rc < 0) {
+      if (n || (!ss->err && (errno == ETIMEDOUT || errno == EAGAIN)))
+        break;
+      return Nan::ThrowError(Nan::ErrnoException(errno, "securerecv"));
+    }
+    if (rc)
+      Set(msgs, n++, m);
+  }
+  hist_record(HIST_SECURERECV, t0);
+  ret(msgs);
+}
+
+/* wipes the session keys, the connection stays open */
+NAN_METHOD(secureclose){
+  secure_free(UnwrapPointer<struct secure *>(info[0]));
+}
+
+#endif
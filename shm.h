@@ -0,0 +1,498 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Shared memory rings                                                       */
+/******************************************************************************/
+
+/* Same-host byte streams over a pair of single-producer single-consumer
+   rings in a memfd, one per direction, set up over an existing unix
+   connection. Each ring's data is mapped twice back to back, so copies and
+   delimiter scans never deal with the wrap. Sends and receives are memcpys
+   and atomic position updates; an eventfd is only written when the other
+   side announced that it is about to sleep on it.
+
+   Like tcp, sends stay unpublished until the next flush, or until the ring
+   fills up. */
+
+#ifdef __linux__
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+#define SHM_HDRSZ (64 * 1024)   /* per ring header, page aligned anywhere */
+#define SHM_DEFCAP (256 * 1024) /* ring data bytes per direction */
+#define SHM_LINE 64
+
+struct shm_ring {
+  uint64_t head;   /* published write position, the producer's */
+  char pad0[SHM_LINE - sizeof(uint64_t)];
+  uint64_t tail;   /* read position, the consumer's */
+  char pad1[SHM_LINE - sizeof(uint64_t)];
+  uint32_t rwait;  /* consumer is about to sleep on the data eventfd */
+  uint32_t wwait;  /* producer is about to sleep on the space eventfd */
+  uint32_t closed;
+  uint64_t cap;
+};
+
+/* the eventfds each side holds, in the order they are passed */
+enum { SHM_TXDATA, SHM_TXSPACE, SHM_RXDATA, SHM_RXSPACE, SHM_NEFD };
+
+struct shm {
+  char *hdrs;
+  char *tx;
+  char *rx;
+  struct shm_ring *txr;
+  struct shm_ring *rxr;
+  uint64_t cap;
+  uint64_t pending; /* written but not yet published */
+  int efd[SHM_NEFD];
+};
+
+static int shm_memfd(const char *name) {
+#ifdef SYS_memfd_create
+  return syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* cap bytes of fd at off, mapped twice in a row */
+static char *shm_map2(int fd, off_t off, size_t cap) {
+  char *base = (char *)mmap(NULL, 2 * cap, PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+  for (int i = 0; i < 2; i++) {
+    if (mmap(base + i * cap, cap, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, fd, off) == MAP_FAILED) {
+      int err = errno;
+      munmap(base, 2 * cap);
+      errno = err;
+      return NULL;
+    }
+  }
+  return base;
+}
+
+static void shm_free(struct shm *sh) {
+  if (sh->hdrs)
+    munmap(sh->hdrs, 2 * SHM_HDRSZ);
+  if (sh->tx)
+    munmap(sh->tx, 2 * sh->cap);
+  if (sh->rx)
+    munmap(sh->rx, 2 * sh->cap);
+  for (int i = 0; i < SHM_NEFD; i++) {
+    if (sh->efd[i] >= 0) {
+      fdclean(sh->efd[i]);
+      close(sh->efd[i]);
+    }
+  }
+  free(sh);
+}
+
+/* Maps the memfd laid out as two headers then two data regions. The side
+   that created it sends on ring 0, the other on ring 1. Takes over the
+   eventfds; the memfd itself can be closed once mapped. */
+static struct shm *shm_open(int mfd, const int *efd, int creator) {
+  struct shm *sh = (struct shm *)calloc(1, sizeof(struct shm));
+  assert(sh);
+  memcpy(sh->efd, efd, sizeof(sh->efd));
+
+  sh->hdrs = (char *)mmap(NULL, 2 * SHM_HDRSZ, PROT_READ | PROT_WRITE,
+    MAP_SHARED, mfd, 0);
+  if (sh->hdrs == MAP_FAILED) {
+    sh->hdrs = NULL;
+    goto fail;
+  }
+
+  {
+    struct shm_ring *r0 = (struct shm_ring *)sh->hdrs;
+    struct shm_ring *r1 = (struct shm_ring *)(sh->hdrs + SHM_HDRSZ);
+    struct stat st;
+    sh->cap = r0->cap;
+    if (fstat(mfd, &st) || !sh->cap || (sh->cap & (sh->cap - 1)) ||
+        (uint64_t)st.st_size != 2 * SHM_HDRSZ + 2 * sh->cap) {
+      errno = EPROTO;
+      goto fail;
+    }
+
+    char *d0 = shm_map2(mfd, 2 * SHM_HDRSZ, sh->cap);
+    char *d1 = d0 ? shm_map2(mfd, 2 * SHM_HDRSZ + sh->cap, sh->cap) : NULL;
+    sh->tx = creator ? d0 : d1;
+    sh->rx = creator ? d1 : d0;
+    if (!d0 || !d1)
+      goto fail;
+    sh->txr = creator ? r0 : r1;
+    sh->rxr = creator ? r1 : r0;
+    sh->pending = sh->txr->head;
+  }
+  return sh;
+
+fail:
+  int err = errno;
+  shm_free(sh);
+  errno = err;
+  return NULL;
+}
+
+static void shm_wake(int efd) {
+  uint64_t one = 1;
+  ssize_t rc = write(efd, &one, sizeof(one));
+  (void)rc; /* EAGAIN means a wakeup is already pending */
+}
+
+/* Sleeps until there is something to read (in) or room to write, or the
+   peer closed. The wait flag goes up before the final check, and the other
+   side updates its position before it looks at the flag, so a wakeup can
+   not fall in between. Returns 0, or -1 with errno ETIMEDOUT. */
+static int shm_wait(struct shm *sh, int in, int64_t deadline) {
+  struct shm_ring *r = in ? sh->rxr : sh->txr;
+  uint32_t *flag = in ? &r->rwait : &r->wwait;
+  int efd = sh->efd[in ? SHM_RXDATA : SHM_TXSPACE];
+
+  for (;;) {
+    __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+    int ready = in ?
+      __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail :
+      sh->pending - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) < sh->cap;
+    if (ready || __atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+      return 0;
+    }
+
+    int rc = fdwait(efd, FDW_IN, deadline);
+    __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+    if (!(rc & FDW_IN)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    uint64_t cnt;
+    ssize_t sz = read(efd, &cnt, sizeof(cnt));
+    (void)sz;
+  }
+}
+
+/* makes the written bytes visible, waking the consumer if it sleeps */
+static void shm_publish(struct shm *sh) {
+  struct shm_ring *r = sh->txr;
+  if (r->head == sh->pending)
+    return;
+  __atomic_store_n(&r->head, sh->pending, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->rwait, __ATOMIC_SEQ_CST))
+    shm_wake(sh->efd[SHM_TXDATA]);
+}
+
+/* hands n read bytes back to the producer, waking it if it sleeps */
+static void shm_consume(struct shm *sh, size_t n) {
+  struct shm_ring *r = sh->rxr;
+  __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->wwait, __ATOMIC_SEQ_CST))
+    shm_wake(sh->efd[SHM_RXSPACE]);
+}
+
+/* Copies len bytes behind the unpublished ones, publishing and waiting for
+   room whenever the ring is full. Returns 0, or -1 with errno set. */
+static int shm_write(struct shm *sh, const char *p, size_t len,
+  int64_t deadline) {
+  struct shm_ring *r = sh->txr;
+  while (len) {
+    if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+      errno = EPIPE;
+      return -1;
+    }
+    size_t room = sh->cap -
+      (sh->pending - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    if (!room) {
+      shm_publish(sh);
+      if (shm_wait(sh, 0, deadline))
+        return -1;
+      continue;
+    }
+    size_t n = len < room ? len : room;
+    memcpy(sh->tx + (sh->pending & (sh->cap - 1)), p, n);
+    sh->pending += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Bytes readable right now, after waiting up to the deadline for any. 0
+   with errno ETIMEDOUT, or ECONNRESET once the peer closed and all it sent
+   was read. */
+static size_t shm_readable(struct shm *sh, int64_t deadline) {
+  struct shm_ring *r = sh->rxr;
+  for (;;) {
+    size_t n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+    if (n)
+      return n;
+    if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+      errno = ECONNRESET;
+      return 0;
+    }
+    if (shm_wait(sh, 1, deadline))
+      return 0;
+  }
+}
+
+/* Reads exactly len bytes, fewer once the deadline passed (errno ETIMEDOUT)
+   or the peer closed (ECONNRESET). Returns the bytes read. */
+static size_t shm_read(struct shm *sh, char *dst, size_t len,
+  int64_t deadline) {
+  size_t sz = 0;
+  while (sz < len) {
+    size_t n = shm_readable(sh, deadline);
+    if (!n)
+      return sz;
+    if (n > len - sz)
+      n = len - sz;
+    memcpy(dst + sz, sh->rx + (sh->rxr->tail & (sh->cap - 1)), n);
+    shm_consume(sh, n);
+    sz += n;
+  }
+  return sz;
+}
+
+/* stream_recvuntil over the ring, same results */
+static size_t shm_recvuntil(struct shm *sh, char *dst, size_t len,
+  const struct delims *d, int64_t deadline) {
+  size_t sz = 0;
+  for (;;) {
+    size_t avail = shm_readable(sh, deadline);
+    if (!avail)
+      return sz;
+    size_t n = avail < len - sz ? avail : len - sz;
+    memcpy(dst + sz, sh->rx + (sh->rxr->tail & (sh->cap - 1)), n);
+
+    size_t dlen;
+    ssize_t at = delims_find(d, dst, delims_from(d, sz), sz + n, &dlen);
+    if (at >= 0)
+      n = at + dlen - sz;
+    shm_consume(sh, n);
+    sz += n;
+
+    if (at >= 0) {
+      errno = 0;
+      return sz;
+    }
+    if (sz == len) {
+      errno = ENOBUFS;
+      return sz;
+    }
+  }
+}
+
+/* Creates the memfd and eventfds and sends them over the unix connection.
+   Returns the session, or NULL with errno set. */
+static struct shm *shm_create(struct stream *st, size_t cap,
+  int64_t deadline) {
+  size_t c = SHM_HDRSZ;
+  while (c < cap)
+    c <<= 1;
+
+  int fds[1 + SHM_NEFD];
+  for (int i = 0; i < 1 + SHM_NEFD; i++)
+    fds[i] = -1;
+
+  struct shm *sh = NULL;
+  int mfd = shm_memfd("mill-shm");
+  if (mfd < 0 || ftruncate(mfd, 2 * SHM_HDRSZ + 2 * c))
+    goto out;
+  fds[0] = mfd;
+
+  {
+    /* headers first, shm_open reads the capacity from them */
+    char *hdrs = (char *)mmap(NULL, 2 * SHM_HDRSZ, PROT_READ | PROT_WRITE,
+      MAP_SHARED, mfd, 0);
+    if (hdrs == MAP_FAILED)
+      goto out;
+    ((struct shm_ring *)hdrs)->cap = c;
+    ((struct shm_ring *)(hdrs + SHM_HDRSZ))->cap = c;
+    munmap(hdrs, 2 * SHM_HDRSZ);
+  }
+
+  /* ring 0 data and space, then ring 1 */
+  for (int i = 1; i <= SHM_NEFD; i++)
+    if ((fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      goto out;
+
+  if (unix_sendfds(st, fds, 1 + SHM_NEFD, deadline))
+    goto out;
+
+  sh = shm_open(mfd, fds + 1, 1);
+  if (sh)
+    fds[1] = fds[2] = fds[3] = fds[4] = -1;
+
+out:
+  int err = errno;
+  for (int i = 0; i < 1 + SHM_NEFD; i++)
+    if (fds[i] >= 0)
+      close(fds[i]);
+  errno = err;
+  return sh;
+}
+
+/* the other end of shm_create */
+static struct shm *shm_accept(struct stream *st, int64_t deadline) {
+  int fds[1 + SHM_NEFD];
+  if (unix_recvfds(st, fds, 1 + SHM_NEFD, deadline))
+    return NULL;
+
+  /* the creator's tx is this side's rx */
+  int efd[SHM_NEFD] = { fds[3], fds[4], fds[1], fds[2] };
+  struct shm *sh = shm_open(fds[0], efd, 0);
+  int err = errno;
+  close(fds[0]);
+  if (!sh)
+    for (int i = 1; i <= SHM_NEFD; i++)
+      close(fds[i]);
+  errno = err;
+  return sh;
+}
+
+//api: shmconnect(s, capacity, deadline), over a connected unixsock
+NAN_METHOD(shmconnect){
+  MILL_GUARD("shmconnect");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  size_t cap = SHM_DEFCAP;
+  if (info[1]->IsNumber())
+    cap = To<uint32_t>(info[1]).FromJust();
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  struct shm *sh = shm_create(&st, cap, deadline);
+  if (!sh)
+    return Nan::ThrowError(Nan::ErrnoException(errno, "shmconnect"));
+  ret(WrapPointer(sh, sizeof(struct shm *)));
+}
+
+//api: shmaccept(s, deadline), null on deadline
+NAN_METHOD(shmaccept){
+  MILL_GUARD("shmaccept");
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[1]->IsNumber())
+    deadline = now() + To<int64_t>(info[1]).FromJust();
+
+  struct stream st;
+  stream_unix(UnwrapPointer<unixsock>(info[0]), &st);
+  struct shm *sh = shm_accept(&st, deadline);
+  if (!sh) {
+    if (errno == ETIMEDOUT)
+      return ret(Nan::Null());
+    return Nan::ThrowError(Nan::ErrnoException(errno, "shmaccept"));
+  }
+  ret(WrapPointer(sh, sizeof(struct shm *)));
+}
+
+//api: shmsend(sh, buf | [bufs], deadline)
+NAN_METHOD(shmsend){
+  MILL_GUARD("shmsend");
+  struct shm *sh = UnwrapPointer<struct shm *>(info[0]);
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  uint32_t n = 1;
+  Local<Array> arr;
+  if (info[1]->IsArray()) {
+    arr = info[1].As<Array>();
+    n = arr->Length();
+  }
+
+  size_t sz = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> b = info[1]->IsArray() ?
+      Nan::Get(arr, i).ToLocalChecked() : info[1];
+    if (shm_write(sh, node::Buffer::Data(b), node::Buffer::Length(b),
+        deadline))
+      return Nan::ThrowError(Nan::ErrnoException(errno, "shmsend"));
+    sz += node::Buffer::Length(b);
+  }
+  ret(New<Number>(sz));
+}
+
+/* never blocks, the ring already holds the bytes */
+NAN_METHOD(shmflush){
+  MILL_GUARD("shmflush");
+  shm_publish(UnwrapPointer<struct shm *>(info[0]));
+}
+
+//api: shmrecv(sh, len, deadline), fewer bytes on deadline or peer close
+NAN_METHOD(shmrecv){
+  MILL_GUARD("shmrecv");
+  struct shm *sh = UnwrapPointer<struct shm *>(info[0]);
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  size_t len = To<uint32_t>(info[1]).FromJust();
+  char *buf = pool_alloc(len);
+  size_t sz = shm_read(sh, buf, len, deadline);
+  ret(pool_buffer(buf, sz));
+}
+
+//api: shmrecvuntil(sh, len, deadline, delims), delims default to '\r'
+NAN_METHOD(shmrecvuntil){
+  MILL_GUARD("shmrecvuntil");
+  struct shm *sh = UnwrapPointer<struct shm *>(info[0]);
+  struct delims until;
+  if (delims_parse(info[3], &until))
+    return;
+
+  /* deadline */
+  int64_t deadline = -1;
+  if (info[2]->IsNumber())
+    deadline = now() + To<int64_t>(info[2]).FromJust();
+
+  size_t len = To<uint32_t>(info[1]).FromJust();
+  char *buf = pool_alloc(len);
+  size_t sz = shm_recvuntil(sh, buf, len, &until, deadline);
+  ret(pool_buffer(buf, sz));
+}
+
+/* publishes what is pending and tells the peer, the unixsock stays open */
+NAN_METHOD(shmclose){
+  MILL_GUARD("shmclose");
+  struct shm *sh = UnwrapPointer<struct shm *>(info[0]);
+  shm_publish(sh);
+  __atomic_store_n(&sh->txr->closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&sh->rxr->closed, 1, __ATOMIC_SEQ_CST);
+  shm_wake(sh->efd[SHM_TXDATA]);
+  shm_wake(sh->efd[SHM_RXSPACE]);
+  shm_free(sh);
+}
+
+#endif
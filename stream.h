@@ -0,0 +1,721 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Streams                                                                   */
+/******************************************************************************/
+
+/* The buffered fd behind a libmill tcp or unix connection. The binding reads
+   and writes through it with the same ibuf/obuf bookkeeping libmill uses, so
+   its calls and libmill's can be mixed on one connection. */
+struct stream {
+  void *sock;     /* the tcpsock or unixsock, keys the per-fd side tables */
+  int fd;
+  size_t *ifirst;
+  size_t *ilen;
+  size_t *olen;
+  char *ibuf;
+  char *obuf;
+  size_t buflen;
+  int unbuffered; /* sends bypass obuf, see tcpopts() */
+  double *stat;   /* see iostat() */
+};
+
+#ifdef MSG_NOSIGNAL
+#define STREAM_NOSIGNAL MSG_NOSIGNAL
+#else
+#define STREAM_NOSIGNAL 0
+#endif
+
+/* iovecs per sendmsg, well under any IOV_MAX */
+#define STREAM_IOVMAX 256
+
+static void stream_tcp(tcpsock s, struct stream *st) {
+  if (s->type != MILL_TCPCONN)
+    abort(); // abort trap! stream calls on a listening sock..
+  struct mill_tcpconn *conn = (struct mill_tcpconn *)s;
+  st->sock = s;
+  st->fd = conn->fd;
+  st->ifirst = &conn->ifirst;
+  st->ilen = &conn->ilen;
+  st->olen = &conn->olen;
+  st->ibuf = conn->ibuf;
+  st->obuf = conn->obuf;
+  st->buflen = TCP_BUFLEN;
+  st->unbuffered = tcpunbuffered(s);
+  st->stat = iostat(s, conn->fd);
+}
+
+/* Reads more into ibuf, moving what is left to the front first.
+   Returns 0, or -1 with errno set (ETIMEDOUT once the deadline passed). */
+static int stream_fill(struct stream *st, int64_t deadline) {
+  if (*st->ifirst) {
+    memmove(st->ibuf, st->ibuf + *st->ifirst, *st->ilen);
+    *st->ifirst = 0;
+  }
+  if (*st->ilen == st->buflen) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  for (;;) {
+    ssize_t sz = recv(st->fd, st->ibuf + *st->ilen,
+      st->buflen - *st->ilen, 0);
+    iostat_syscall(st->stat, sz);
+    if (sz > 0) {
+      *st->ilen += sz;
+      return 0;
+    }
+    if (sz == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (!fdwait(st->fd, FDW_IN, deadline)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+/* Reads exactly len bytes into dst, what ibuf holds first, the rest straight
+   from the kernel. Like libmill's tcprecv, returns the bytes read, fewer
+   than len with errno set when the deadline passed or the stream failed. */
+static size_t stream_read(struct stream *st, char *dst, size_t len,
+  int64_t deadline) {
+  size_t got = *st->ilen < len ? *st->ilen : len;
+  memcpy(dst, st->ibuf + *st->ifirst, got);
+  *st->ifirst += got;
+  *st->ilen -= got;
+
+  while (got < len) {
+    ssize_t sz = recv(st->fd, dst + got, len - got, 0);
+    iostat_syscall(st->stat, sz);
+    if (sz > 0) {
+      got += sz;
+      continue;
+    }
+    if (sz == 0) {
+      errno = ECONNRESET;
+      return got;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return got;
+    if (!fdwait(st->fd, FDW_IN, deadline)) {
+      errno = ETIMEDOUT;
+      return got;
+    }
+  }
+  errno = 0;
+  return got;
+}
+
+#ifdef __linux__
+/* Splices go through one shared pipe, empty in between calls. When dst
+   stalls past the deadline with bytes already in the pipe, the pipe moves
+   to dst's entry here, indexed by fd like the other side tables, and goes
+   out ahead of anything else written to dst. */
+struct stream_pipe {
+  void *sock;
+  int pfd[2];
+  size_t pending;
+};
+
+static int stream_pfd[2] = { -1, -1 };
+static struct stream_pipe *stream_pipes;
+static size_t stream_pipes_len;
+
+static void stream_pipe_free(int *pfd) {
+  int err = errno;
+  close(pfd[0]);
+  close(pfd[1]);
+  pfd[0] = pfd[1] = -1;
+  errno = err;
+}
+
+/* dst's parked pipe, NULL without one */
+static struct stream_pipe *stream_pipe(struct stream *st) {
+  size_t fd = st->fd;
+  if (fd >= stream_pipes_len || !stream_pipes[fd].pending)
+    return NULL;
+  struct stream_pipe *p = &stream_pipes[fd];
+  if (p->sock != st->sock) {
+    /* left over from a socket that reused the fd without a close */
+    stream_pipe_free(p->pfd);
+    memset(p, 0, sizeof *p);
+    return NULL;
+  }
+  return p;
+}
+
+static void stream_pipe_park(struct stream *st, size_t pending) {
+  size_t fd = st->fd;
+  if (fd >= stream_pipes_len) {
+    size_t len = fd * 2 + 64;
+    stream_pipes = (struct stream_pipe *)realloc(stream_pipes,
+      len * sizeof(struct stream_pipe));
+    assert(stream_pipes);
+    memset(stream_pipes + stream_pipes_len, 0,
+      (len - stream_pipes_len) * sizeof(struct stream_pipe));
+    stream_pipes_len = len;
+  }
+  struct stream_pipe *p = &stream_pipes[fd];
+  p->sock = st->sock;
+  p->pfd[0] = stream_pfd[0];
+  p->pfd[1] = stream_pfd[1];
+  p->pending = pending;
+  stream_pfd[0] = stream_pfd[1] = -1;
+}
+
+/* Writes out what a timed out splice left for st. Returns 0, -1 with errno
+   set; a broken socket takes the bytes with it. */
+static int stream_pipe_flush(struct stream *st, int64_t deadline) {
+  struct stream_pipe *p = stream_pipe(st);
+  if (!p)
+    return 0;
+  while (p->pending) {
+    ssize_t out = splice(p->pfd[0], NULL, st->fd, NULL, p->pending,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    iostat_syscall(st->stat, out);
+    if (out > 0) {
+      p->pending -= out;
+      continue;
+    }
+    if (out < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      break;
+    if (!fdwait(st->fd, FDW_OUT, deadline)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+  int rc = p->pending ? -1 : 0;
+  /* an empty pipe can serve the next splice */
+  if (!p->pending && stream_pfd[0] < 0) {
+    stream_pfd[0] = p->pfd[0];
+    stream_pfd[1] = p->pfd[1];
+  } else {
+    stream_pipe_free(p->pfd);
+  }
+  memset(p, 0, sizeof *p);
+  return rc;
+}
+#else
+static int stream_pipe_flush(struct stream *st, int64_t deadline) {
+  return 0;
+}
+#endif
+
+/* drops what a splice left parked for s, see tcpclose() */
+static void stream_pipe_close(void *s, int fd) {
+#ifdef __linux__
+  if ((size_t)fd >= stream_pipes_len || stream_pipes[fd].sock != s ||
+      !stream_pipes[fd].pending)
+    return;
+  stream_pipe_free(stream_pipes[fd].pfd);
+  memset(&stream_pipes[fd], 0, sizeof(struct stream_pipe));
+#endif
+}
+
+/* Writes obuf followed by iov[0..n) in as few gather writes as the kernel
+   allows; iov is consumed in place, what is left of it was not written.
+   Returns 0, or -1 with errno set. */
+static int stream_writev(struct stream *st, struct iovec *iov, int n,
+  int64_t deadline) {
+  struct iovec vec[STREAM_IOVMAX];
+  int first = 0;
+
+  /* bytes a splice already took off its src go first */
+  if (stream_pipe_flush(st, deadline))
+    return -1;
+
+  for (;;) {
+    while (first < n && iov[first].iov_len == 0)
+      first++;
+
+    int cnt = 0;
+    if (*st->olen) {
+      vec[cnt].iov_base = st->obuf;
+      vec[cnt++].iov_len = *st->olen;
+    }
+    for (int i = first; i < n && cnt < STREAM_IOVMAX; i++)
+      vec[cnt++] = iov[i];
+    if (!cnt)
+      return 0;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = vec;
+    hdr.msg_iovlen = cnt;
+    ssize_t sz = sendmsg(st->fd, &hdr, STREAM_NOSIGNAL);
+    iostat_syscall(st->stat, sz);
+    if (sz < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      if (!fdwait(st->fd, FDW_OUT, deadline)) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      continue;
+    }
+
+    /* obuf went out first */
+    size_t k = (size_t)sz < *st->olen ? sz : *st->olen;
+    memmove(st->obuf, st->obuf + k, *st->olen - k);
+    *st->olen -= k;
+    sz -= k;
+
+    while (sz > 0) {
+      if ((size_t)sz >= iov[first].iov_len) {
+        sz -= iov[first].iov_len;
+        iov[first++].iov_len = 0;
+      } else {
+        iov[first].iov_base = (char *)iov[first].iov_base + sz;
+        iov[first].iov_len -= sz;
+        sz = 0;
+      }
+    }
+  }
+}
+
+/* Sends iov[0..n) the way libmill's send buffers a single payload: all of
+   it is copied to obuf when it fits, otherwise (or on an unbuffered stream)
+   obuf and the payload go out in gather writes with no intermediate copy.
+   Like libmill's tcpsend, returns the bytes of iov sent or buffered, fewer
+   than all of them with errno set. */
+static size_t stream_sendv(struct stream *st, struct iovec *iov, int n,
+  int64_t deadline) {
+  size_t total = 0;
+  for (int i = 0; i < n; i++)
+    total += iov[i].iov_len;
+
+  if (st->unbuffered || total > st->buflen - *st->olen) {
+    if (!stream_writev(st, iov, n, deadline)) {
+      errno = 0;
+      return total;
+    }
+    int err = errno;
+    for (int i = 0; i < n; i++)
+      total -= iov[i].iov_len;
+    errno = err;
+    return total;
+  }
+
+  for (int i = 0; i < n; i++) {
+    memcpy(st->obuf + *st->olen, iov[i].iov_base, iov[i].iov_len);
+    *st->olen += iov[i].iov_len;
+  }
+  errno = 0;
+  return total;
+}
+
+/* throws a TypeError unless bufs is a Buffer or an array of them */
+static bool stream_checkbufs(Local<Value> bufs) {
+  if (!bufs->IsArray()) {
+    if (node::Buffer::HasInstance(bufs))
+      return true;
+    Nan::ThrowTypeError("expected a Buffer or an array of Buffers");
+    return false;
+  }
+  Local<Array> arr = bufs.As<Array>();
+  for (uint32_t i = 0; i < arr->Length(); i++)
+    if (!node::Buffer::HasInstance(Nan::Get(arr, i).ToLocalChecked())) {
+      Nan::ThrowTypeError("expected a Buffer or an array of Buffers");
+      return false;
+    }
+  return true;
+}
+
+/* sends one Buffer or an array of them, checked by stream_checkbufs, returns
+   the bytes sent, fewer than all of them with errno set */
+static size_t stream_sendbufs(struct stream *st, Local<Value> bufs,
+  int64_t deadline) {
+  uint32_t n = 1;
+  Local<Array> arr;
+  if (bufs->IsArray()) {
+    arr = bufs.As<Array>();
+    n = arr->Length();
+  }
+
+  struct iovec *iov = (struct iovec *)malloc((n ? n : 1) * sizeof(struct iovec));
+  assert(iov);
+
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> b = bufs->IsArray() ? Nan::Get(arr, i).ToLocalChecked() : bufs;
+    iov[i].iov_base = node::Buffer::Data(b);
+    iov[i].iov_len = node::Buffer::Length(b);
+  }
+
+  size_t sz = stream_sendv(st, iov, n, deadline);
+  int err = errno;
+  free(iov);
+  errno = err;
+  return sz;
+}
+
+/******************************************************************************/
+/*  Zero-copy transfers                                                       */
+/******************************************************************************/
+
+/* Files and socket-to-socket transfers that never bring the payload into
+   user space. What the streams already buffered goes first so the bytes stay
+   in order. Elsewhere than linux both fall back to a read/write loop. */
+
+#define STREAM_XFERCHUNK (64 * 1024)
+
+/* Sends len bytes of fd starting at off, after obuf. Returns the bytes sent,
+   fewer when fd ended early or the deadline passed (errno ETIMEDOUT), -1
+   with errno set on errors. */
+static ssize_t stream_sendfile(struct stream *st, int fd, off_t off,
+  size_t len, int64_t deadline) {
+  if (stream_writev(st, NULL, 0, deadline))
+    return errno == ETIMEDOUT ? 0 : -1;
+
+  size_t sent = 0;
+#ifdef __linux__
+  while (sent < len) {
+    ssize_t sz = sendfile(st->fd, fd, &off, len - sent);
+    iostat_syscall(st->stat, sz);
+    if (sz > 0) {
+      sent += sz;
+      continue;
+    }
+    if (sz == 0)
+      break;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (!fdwait(st->fd, FDW_OUT, deadline)) {
+      errno = ETIMEDOUT;
+      break;
+    }
+  }
+#else
+  char *chunk = (char *)malloc(STREAM_XFERCHUNK);
+  assert(chunk);
+  while (sent < len) {
+    size_t n = len - sent < STREAM_XFERCHUNK ? len - sent : STREAM_XFERCHUNK;
+    ssize_t sz = pread(fd, chunk, n, off + sent);
+    if (sz <= 0)
+      break;
+    struct iovec iov = { chunk, (size_t)sz };
+    if (stream_writev(st, &iov, 1, deadline)) {
+      sent += sz - iov.iov_len;
+      if (errno == ETIMEDOUT)
+        break;
+      free(chunk);
+      return -1;
+    }
+    sent += sz;
+  }
+  free(chunk);
+#endif
+  return sent;
+}
+
+/* Moves up to len bytes from src to dst: dst's obuf and src's ibuf first,
+   the rest through a pipe with splice. Stops at len, when src ends, on an
+   error, or once the deadline passed waiting for either side (errno
+   ETIMEDOUT). Bytes already taken off src that dst did not take by the
+   deadline stay queued for dst (its parked pipe, or obuf elsewhere than
+   linux) and count as moved. Returns the bytes moved, with errno set when
+   it stopped early; -1 only when nothing moved. */
+static ssize_t stream_splice(struct stream *src, struct stream *dst,
+  size_t len, int64_t deadline) {
+  if (stream_writev(dst, NULL, 0, deadline))
+    return errno == ETIMEDOUT ? 0 : -1;
+
+  size_t moved = 0;
+  if (*src->ilen && len) {
+    size_t n = *src->ilen < len ? *src->ilen : len;
+    struct iovec iov = { src->ibuf + *src->ifirst, n };
+    int rc = stream_writev(dst, &iov, 1, deadline);
+    *src->ifirst += n - iov.iov_len;
+    *src->ilen -= n - iov.iov_len;
+    moved += n - iov.iov_len;
+    if (rc)
+      return errno == ETIMEDOUT || moved ? (ssize_t)moved : -1;
+  }
+
+#ifdef __linux__
+  int *pfd = stream_pfd;
+  if (pfd[0] < 0 && pipe2(pfd, O_NONBLOCK | O_CLOEXEC))
+    return -1;
+
+  while (moved < len) {
+    size_t n = len - moved < STREAM_XFERCHUNK ? len - moved : STREAM_XFERCHUNK;
+    ssize_t in = splice(src->fd, NULL, pfd[1], NULL, n,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    iostat_syscall(src->stat, in);
+    if (in == 0)
+      break;
+    if (in < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return moved ? (ssize_t)moved : -1;
+      if (!fdwait(src->fd, FDW_IN, deadline)) {
+        errno = ETIMEDOUT;
+        break;
+      }
+      continue;
+    }
+
+    while (in) {
+      ssize_t out = splice(pfd[0], NULL, dst->fd, NULL, in,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      iostat_syscall(dst->stat, out);
+      if (out > 0) {
+        in -= out;
+        moved += out;
+        continue;
+      }
+      if (out < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        /* dst is broken, what is in the pipe has nowhere to go */
+        stream_pipe_free(pfd);
+        return moved ? (ssize_t)moved : -1;
+      }
+      if (fdwait(dst->fd, FDW_OUT, deadline))
+        continue;
+
+      /* dst did not take the rest in time, the pipe stays with it */
+      stream_pipe_park(dst, in);
+      errno = ETIMEDOUT;
+      return moved + in;
+    }
+  }
+#else
+  /* obuf is empty after every write that went through, so a chunk of at
+     most buflen always has room there when dst stalls */
+  char *chunk = (char *)malloc(dst->buflen);
+  assert(chunk);
+  while (moved < len) {
+    size_t n = len - moved < dst->buflen ? len - moved : dst->buflen;
+    ssize_t in = recv(src->fd, chunk, n, 0);
+    iostat_syscall(src->stat, in);
+    if (in == 0)
+      break;
+    if (in < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        free(chunk);
+        return moved ? (ssize_t)moved : -1;
+      }
+      if (!fdwait(src->fd, FDW_IN, deadline)) {
+        errno = ETIMEDOUT;
+        break;
+      }
+      continue;
+    }
+    struct iovec iov = { chunk, (size_t)in };
+    if (stream_writev(dst, &iov, 1, deadline)) {
+      int err = errno;
+      if (err == ETIMEDOUT) {
+        /* dst did not take the rest in time, it waits in obuf */
+        memcpy(dst->obuf + *dst->olen, iov.iov_base, iov.iov_len);
+        *dst->olen += iov.iov_len;
+        moved += in;
+      } else {
+        moved += in - iov.iov_len;
+      }
+      free(chunk);
+      errno = err;
+      return moved ? (ssize_t)moved : -1;
+    }
+    moved += in;
+  }
+  free(chunk);
+#endif
+  return moved;
+}
+
+/******************************************************************************/
+/*  Delimiters                                                                */
+/******************************************************************************/
+
+/* recvuntil stops at the first of a set of delimiter sequences. The scan
+   looks for the sequences' first bytes a vector at a time and only compares
+   whole sequences where one of those bytes turns up. */
+
+#define DELIM_MAX 8     /* sequences per set */
+#define DELIM_SEQMAX 16 /* bytes per sequence */
+
+struct delims {
+  int n;
+  size_t len[DELIM_MAX];
+  unsigned char seq[DELIM_MAX][DELIM_SEQMAX];
+  size_t maxlen;
+
+  /* distinct first bytes of the sequences */
+  int nfirst;
+  unsigned char first[DELIM_MAX];
+};
+
+static int delims_add(struct delims *d, const char *p, size_t len) {
+  if (d->n == DELIM_MAX) {
+    Nan::ThrowRangeError("too many delimiters");
+    return -1;
+  }
+  if (len == 0 || len > DELIM_SEQMAX) {
+    Nan::ThrowRangeError("delimiter must be 1 to 16 bytes");
+    return -1;
+  }
+
+  memcpy(d->seq[d->n], p, len);
+  d->len[d->n++] = len;
+  if (len > d->maxlen)
+    d->maxlen = len;
+
+  for (int i = 0; i < d->nfirst; i++)
+    if (d->first[i] == (unsigned char)p[0])
+      return 0;
+  d->first[d->nfirst++] = p[0];
+  return 0;
+}
+
+static int delims_value(struct delims *d, Local<Value> v) {
+  if (node::Buffer::HasInstance(v))
+    return delims_add(d, node::Buffer::Data(v), node::Buffer::Length(v));
+  if (v->IsString()) {
+    utf8 s(v);
+    return delims_add(d, *s, s.length());
+  }
+  Nan::ThrowTypeError("delimiter must be a string or a Buffer");
+  return -1;
+}
+
+/* A string or Buffer is one sequence ('\r\n' ends a line at CRLF only), an
+   array of them is a set. None means libmill's '\r'. Returns -1 and throws on
+   a bad set. */
+static int delims_parse(Local<Value> v, struct delims *d) {
+  memset(d, 0, sizeof(*d));
+  if (v->IsUndefined() || v->IsNull())
+    return delims_add(d, "\r", 1);
+
+  if (!v->IsArray())
+    return delims_value(d, v);
+
+  Local<Array> arr = v.As<Array>();
+  for (uint32_t i = 0; i < arr->Length(); i++)
+    if (delims_value(d, Nan::Get(arr, i).ToLocalChecked()))
+      return -1;
+  if (!d->n) {
+    Nan::ThrowRangeError("empty delimiter set");
+    return -1;
+  }
+  return 0;
+}
+
+/* first position in [p, lim) holding a first byte of the set, NULL if none */
+static const char *delims_scan(const struct delims *d, const char *p,
+  const char *lim) {
+  if (d->nfirst == 1)
+    return (const char *)memchr(p, d->first[0], lim - p);
+
+#if defined(__AVX2__)
+  __m256i f[DELIM_MAX];
+  for (int i = 0; i < d->nfirst; i++)
+    f[i] = _mm256_set1_epi8(d->first[i]);
+  for (; lim - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i m = _mm256_cmpeq_epi8(v, f[0]);
+    for (int i = 1; i < d->nfirst; i++)
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, f[i]));
+    unsigned mask = _mm256_movemask_epi8(m);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  __m128i f[DELIM_MAX];
+  for (int i = 0; i < d->nfirst; i++)
+    f[i] = _mm_set1_epi8(d->first[i]);
+  for (; lim - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_cmpeq_epi8(v, f[0]);
+    for (int i = 1; i < d->nfirst; i++)
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, f[i]));
+    unsigned mask = _mm_movemask_epi8(m);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+
+  /* tail, or the whole range without vector support */
+  for (; p < lim; p++)
+    for (int i = 0; i < d->nfirst; i++)
+      if ((unsigned char)*p == d->first[i])
+        return p;
+  return NULL;
+}
+
+/* Offset of the earliest delimiter lying wholly within buf[from, to), -1 if
+   there is none. At one position, sequences are tried in the order given. */
+static ssize_t delims_find(const struct delims *d, const char *buf,
+  size_t from, size_t to, size_t *dlen) {
+  const char *lim = buf + to;
+  for (const char *p = buf + from; (p = delims_scan(d, p, lim)); p++) {
+    for (int i = 0; i < d->n; i++) {
+      if (d->len[i] <= (size_t)(lim - p) &&
+          memcmp(p, d->seq[i], d->len[i]) == 0) {
+        *dlen = d->len[i];
+        return p - buf;
+      }
+    }
+  }
+  return -1;
+}
+
+/* where a rescan of buf[0, sz) plus new bytes has to start so that sequences
+   split across reads are still found */
+static size_t delims_from(const struct delims *d, size_t sz) {
+  return sz >= d->maxlen ? sz - d->maxlen + 1 : 0;
+}
+
+/* libmill's recvuntil over a delimiter set: reads into dst up to and
+   including the delimiter, copying ibuf a chunk at a time and leaving what
+   follows the delimiter buffered. Returns the bytes read, errno is 0 once
+   the delimiter was found, ENOBUFS when dst filled up first. */
+static size_t stream_recvuntil(struct stream *st, char *dst, size_t len,
+  const struct delims *d, int64_t deadline) {
+  size_t sz = 0;
+  for (;;) {
+    size_t n = *st->ilen < len - sz ? *st->ilen : len - sz;
+    memcpy(dst + sz, st->ibuf + *st->ifirst, n);
+
+    size_t dlen;
+    ssize_t at = delims_find(d, dst, delims_from(d, sz), sz + n, &dlen);
+    if (at >= 0)
+      n = at + dlen - sz;
+    *st->ifirst += n;
+    *st->ilen -= n;
+    sz += n;
+
+    if (at >= 0) {
+      errno = 0;
+      return sz;
+    }
+    if (sz == len) {
+      errno = ENOBUFS;
+      return sz;
+    }
+    if (stream_fill(st, deadline))
+      return sz;
+  }
+}
@@ -0,0 +1,59 @@
+module.exports  = chan
+
+function chan (t) {
+  t.test( 'channel send and recv', sendrecv )
+  t.test( 'channel choose', choose )
+  t.test( 'channel calls never block', noblock )
+}
+
+function sendrecv (t) {
+  t.plan(6)
+
+  const ch = t.lib.chanmake(4)
+  const msgs = ['a', 'bb', 'ccc'].map(s => new Buffer(s))
+
+  t.is( t.lib.chansendmany(ch, msgs), 3, 'three msgs in the channel' )
+  t.is( String(t.lib.chanrecv(ch)), 'a', 'first msg out first' )
+
+  const rest = t.lib.chanrecvmany(ch, 10)
+  t.is( rest.map(String).join(), 'bb,ccc', `bulk recv: ${rest.map(String)}` )
+  t.is( t.lib.chanrecv(ch), null, 'empty channel does not block' )
+
+  t.ok( t.lib.chansend(ch, new Buffer('last')), 'chansend into buffer space' )
+  t.lib.chandone(ch)
+  t.lib.chanrecv(ch)
+  t.is( t.lib.chanrecv(ch), null, 'done channel hands out null' )
+
+  t.lib.chanclose(ch)
+}
+
+function choose (t) {
+  t.plan(3)
+
+  const a = t.lib.chanmake(1)
+  const b = t.lib.chanmake(1)
+
+  t.is( t.lib.chanchoose([a, b]), null, 'null with nothing ready' )
+
+  t.lib.chansend(b, new Buffer('from b'))
+  const r = t.lib.chanchoose([a, b])
+  t.is( r.index, 1, 'chose the ready channel' )
+  t.is( String(r.buf), 'from b', `msg: ${r.buf}` )
+
+  t.lib.chanclose(a)
+  t.lib.chanclose(b)
+}
+
+function noblock (t) {
+  t.plan(5)
+
+  const ch = t.lib.chanmake(1)
+
+  t.is( t.lib.chanrecv(ch), null, 'recv from an empty channel returns null' )
+  t.ok( t.lib.chansend(ch, new Buffer('a')), 'send into buffer space' )
+  t.notOk( t.lib.chansend(ch, new Buffer('b')), 'send into a full channel fails' )
+  t.is( t.lib.chanchoose([]), null, 'choose over no channels returns null' )
+  t.throws( () => t.lib.chanmake(0), RangeError, 'unbuffered channel throws' )
+
+  t.lib.chanclose(ch)
+}
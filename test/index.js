@@ -7,7 +7,11 @@ function tests (t) {
   t.test('===== ipaddr buffers =====', require('./ipaddr'))
   t.test('===== socket buffers =====', require('./bufs'))
   t.test('===== tcp library ========', require('./tcp'))
+  t.test('===== unix library =======', require('./unix'))
   t.test('===== udp library ========', require('./udp'))
+  t.test('===== buffer pool ========', require('./pool'))
+  t.test('===== channels ===========', require('./chan'))
+  t.test('===== scheduler thread ===', require('./thread'))
   t.test('===== sodium library =====', require('./sodium'))
 }
 
@@ -0,0 +1,42 @@
+module.exports  = pool
+
+function pool (t) {
+  t.test( 'pooled recv buffers', pooled )
+  t.test( 'pool configuration', configure )
+}
+
+function pooled (t) {
+  t.plan(5)
+
+  const buf = new Buffer('Hello, pool!')
+  const ipaddr = t.lib.iplocal(44448)
+  const s = t.lib.udplisten(ipaddr)
+
+  const before = t.lib.poolstats()
+
+  t.lib.udpsend(s, ipaddr, buf)
+  const msg = t.lib.udprecv(s, 64, 100)
+
+  const after = t.lib.poolstats()
+
+  t.is( String(msg.buf), String(buf), `pooled msg: ${msg.buf}` )
+  t.is( after.hits + after.misses, before.hits + before.misses + 1,
+    `one pool allocation, hits: ${after.hits} misses: ${after.misses}` )
+  t.is( after.inuse, before.inuse + 1, `chunks in use: ${after.inuse}` )
+
+  t.lib.release(msg.buf)
+  t.is( t.lib.poolstats().inuse, before.inuse, 'release() returns the chunk' )
+
+  t.lib.release(msg.buf)
+  t.is( t.lib.poolstats().inuse, before.inuse, 'double release is a no-op' )
+
+  t.lib.udpclose(s)
+}
+
+function configure (t) {
+  t.plan(1)
+
+  /* the tcp and udp tests already pulled in slabs */
+  t.throws( () => t.lib.pool(4096), /pool already in use/,
+    'pool can not be resized once slabs are resident' )
+}
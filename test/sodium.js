@@ -1,3 +1,6 @@
+const spawn = require('child_process').spawn
+const path = require('path')
+
 module.exports  = sodium
 
 function sodium (t) {
@@ -6,6 +9,9 @@ function sodium (t) {
   t.test( 'get and set keys', getandsetkeys )
   t.test( 'set a crypto box keypair', box_keypair )
   t.test( 'nbuf', nbuf )
+  t.test( 'async seal and open', sealopen )
+  if (t.lib.tcpsecure)
+    t.test( 'encrypted tcp stream', secure )
 }
 
 function sodium_version (t) {
@@ -52,3 +58,108 @@ function nbuf (t) {
   t.ok( nonce,   `nonce hex: ${nonce}` )
   t.is( nonce.length,  48, `nonce hex length: ${nonce.length}`   )
 }
+
+function sealopen (t) {
+  t.plan(7)
+
+  const EBADMSG = require('os').constants.errno.EBADMSG
+  const msgs = [new Buffer('a'), new Buffer(100000).fill('b'), new Buffer('c')]
+  t.lib.box_keypair()
+
+  t.lib.histograms()
+  t.lib.histsample(1)
+  t.lib.box_seal(msgs, null, function (sealed, err) {
+    t.same(sealed.map(b => b.length), [41, 100040, 41], 'sealed, nonce first')
+    const n = t.lib.histbounds().length
+    const row = t.lib.histnames.indexOf('box_seal') * n
+    t.is( t.lib.histograms().slice(row, row + n).reduce((a, b) => a + b), 1,
+      'box_seal timed to its callback' )
+
+    sealed[2][30] ^= 1
+    t.lib.box_open(sealed, null, function (opened, err) {
+      t.ok(opened[0].equals(msgs[0]) && opened[1].equals(msgs[1]),
+        'opened in order')
+      t.is(opened[2], null, 'tampered message rejected')
+      t.is(err, EBADMSG, 'errno EBADMSG')
+    })
+  })
+  t.lib.histsample(0)
+
+  /* a big job queued first still calls back first */
+  const order = []
+  t.lib.box_seal(new Buffer(1 << 20), null, () => order.push(1))
+  t.lib.box_seal(new Buffer(1), null, function () {
+    order.push(2)
+    t.same(order, [1, 2], 'callbacks in call order')
+  })
+
+  /* nothing to seal still calls back later, never from inside box_seal */
+  let returned = false
+  t.lib.box_seal([], null, function (sealed, err) {
+    t.ok(returned && sealed.length === 0 && !err, 'empty seal calls back async')
+  })
+  returned = true
+}
+
+/* the handshake needs both ends running, the server is a child process */
+const peer = `
+  const lib = require(${JSON.stringify(path.join(__dirname, '..'))})
+  const ls = lib.tcplisten(lib.iplocal(44451))
+  process.stdout.write('ready')
+  /* echo until bye, twice over: the second client hangs up on its own */
+  for (let round = 0; round < 2; round++) {
+    const as = lib.tcpaccept(ls)
+    const ss = lib.tcpsecure(as, 'server')
+    try {
+      for (;;) {
+        const msgs = lib.securerecv(ss, 16)
+        lib.securesend(ss, msgs)
+        lib.tcpflush(as)
+        if (String(msgs[msgs.length - 1]) === 'bye') break
+      }
+    } catch (err) {}
+    lib.secureclose(ss)
+    lib.tcpclose(as)
+  }
+`
+
+function secure (t) {
+  t.plan(6)
+
+  const child = spawn(process.execPath, ['-e', peer])
+  child.stdout.once('data', function () {
+    const cs = t.lib.tcpconnect(t.lib.iplocal(44451))
+    const ss = t.lib.tcpsecure(cs, 'client', t.lib.kx_keypair(), 1000)
+    const big = new Buffer(200000).fill('z')
+
+    t.is( t.lib.securesend(ss, [new Buffer('hello'), big]), 200005,
+      'sealed a small and a multi-chunk message' )
+    t.lib.tcpflush(cs)
+
+    /* short deadlines cut into the 64k chunks, they resume on the next call */
+    var got = []
+    while (got.length < 2)
+      got = got.concat(t.lib.securerecv(ss, 16, 1))
+    t.is( String(got[0]), 'hello', `echo: ${got[0]}` )
+    t.ok( got[1].equals(big), `echo of ${got[1].length} bytes` )
+
+    t.lib.securesend(ss, new Buffer('bye'))
+    t.lib.tcpflush(cs)
+    t.is( String(t.lib.securerecv(ss, 1, 1000)[0]), 'bye', 'bye' )
+
+    t.lib.secureclose(ss)
+    t.lib.tcpclose(cs)
+
+    /* a message over maxmsg fails the session instead of growing forever */
+    const cs2 = t.lib.tcpconnect(t.lib.iplocal(44451))
+    const ss2 = t.lib.tcpsecure(cs2, 'client', { maxmsg: 100000 }, 1000)
+    t.lib.securesend(ss2, big)
+    t.lib.tcpflush(cs2)
+    t.throws(() => { while (!t.lib.securerecv(ss2, 1, 1000).length); },
+      /EMSGSIZE/, 'echo over maxmsg throws')
+    t.throws(() => t.lib.securerecv(ss2, 1, 10), /EMSGSIZE/,
+      'and the session stays failed')
+    t.lib.secureclose(ss2)
+    t.lib.tcpclose(cs2)
+  })
+}
@@ -5,7 +5,21 @@ module.exports = function tcp (t) {
   t.test('tcp accept', accept)
   t.test('tcp send', send)
   t.test('tcp recv', recvmsg)
+  t.test('tcp async send and recv', async)
+  t.test('tcp recvinto', recvinto)
+  t.test('tcp frames', frames)
+  t.test('tcp frames across deadlines', framesplit)
+  t.test('tcp recvuntil delimiters', recvuntil)
+  t.test('tcp sendv', sendv)
+  t.test('tcp options', opts)
+  t.test('tcp sendstr shared key cache', boxcache)
+  t.test('tcp sendstr crypto contexts', boxctx)
+  t.test('tcp sendfile and splice', zerocopy)
+  t.test('tcp io counters', iostats)
+  t.test('tcp latency histograms', histograms)
+  t.test('tcp async timeouts', timeouts)
   t.test('tcp sendstr', sendstr)
+  t.test('tcp reuseport listeners', reuseport)
 }
 
 function listen (t) {
@@ -50,6 +64,334 @@ function recvmsg (t) {
   t.is(String(recv), String(msg), 'msg: ' + recv)
 }
 
+function async (t) {
+  t.plan(5)
+
+  const amsg = new Buffer('msgs without blocking the event loop\n')
+
+  t.lib.tcprecv(cs, amsg.length, function (buf, err) {
+    t.is(err, 0, 'async tcprecv errno is 0')
+    t.is(String(buf), String(amsg), 'async msg: ' + buf)
+  })
+
+  t.lib.tcpsend(as, amsg, function (sz, err) {
+    t.is(sz, amsg.length, 'async tcpsend msg size is ' + sz + ' bytes')
+    t.is(err, 0, 'async tcpsend errno is 0')
+    t.lib.tcpflush(as, function (err) {
+      t.is(err, 0, 'async tcpflush errno is 0')
+    })
+  })
+}
+
+function recvinto (t) {
+  t.plan(3)
+
+  const target = new Buffer(64).fill(0)
+  const imsg = new Buffer('straight into the caller buffer')
+
+  t.lib.tcpsend(as, imsg)
+  t.lib.tcpflush(as)
+
+  const n = t.lib.tcprecvinto(cs, target, 8, imsg.length)
+
+  t.is(n, imsg.length, 'tcprecvinto returned ' + n + ' bytes')
+  t.is(String(target.slice(8, 8 + n)), String(imsg), 'msg landed at offset 8')
+  t.throws(function () { t.lib.tcprecvinto(cs, target, 60, 8) }, RangeError,
+    'range past the end of target throws')
+}
+
+function frames (t) {
+  t.plan(9)
+
+  const bufs = ['one', 'two', new Array(2000).join('x')].map(s => new Buffer(s))
+
+  /* small frames are buffered, the batch over TCP_BUFLEN is one gather write */
+  t.is(t.lib.tcpsendframe(as, bufs[0]), 3, 'single u32 frame')
+  t.is(t.lib.tcpsendframe(as, bufs, 'varint'), 2005, 'varint frames')
+  t.lib.tcpflush(as)
+
+  var got = t.lib.tcprecvframes(cs, 10)
+  t.is(String(got[0]), 'one', 'u32 frame: ' + got[0])
+
+  got = t.lib.tcprecvframes(cs, 10, 'varint')
+  while (got.length < 3)
+    got = got.concat(t.lib.tcprecvframes(cs, 10, 'varint'))
+
+  t.same(got.map(b => b.length), [3, 3, 1999], 'frame boundaries kept')
+  t.same(t.lib.tcprecvframes(cs, 10, 'u32', 10), [], 'deadline gives []')
+
+  t.throws(() => t.lib.tcpsendframe(as, [bufs[0], 'x']), TypeError,
+    'non-Buffer frame throws')
+  t.throws(() => t.lib.tcpsendframe(as, new Buffer(64 * 1024 * 1024 + 1)),
+    RangeError, 'frame over 64MB throws')
+
+  /* nobody reads c, the deadline leaves the big frame half sent */
+  const c = t.lib.tcpconnect(ipaddr)
+  const a = t.lib.tcpaccept(ls)
+  t.throws(() => t.lib.tcpsendframe(a, new Buffer(32 * 1024 * 1024), 'u32', 50),
+    /ETIMEDOUT/, 'half sent frame times out')
+  t.throws(() => t.lib.tcpsendframe(a, bufs[0]), /ETIMEDOUT/,
+    'later sends fail instead of breaking the framing')
+  t.lib.tcpclose(c)
+  t.lib.tcpclose(a)
+}
+
+/* a deadline halfway through a frame must not lose its place in the stream */
+function framesplit (t) {
+  t.plan(6)
+
+  function raw (len, body) {
+    const hdr = new Buffer(4)
+    hdr.writeUInt32BE(len, 0)
+    t.lib.tcpsend(as, Buffer.concat([hdr, body]))
+    t.lib.tcpflush(as)
+  }
+
+  /* fits in ibuf */
+  raw(10, new Buffer('01234'))
+  t.same(t.lib.tcprecvframes(cs, 10, 'u32', 20), [], 'half a small frame')
+  t.lib.tcpsend(as, new Buffer('56789'))
+  t.lib.tcpsendframe(as, new Buffer('next'))
+  t.lib.tcpflush(as)
+  var got = t.lib.tcprecvframes(cs, 10, 'u32', 100)
+  if (got.length < 2) got = got.concat(t.lib.tcprecvframes(cs, 10, 'u32', 100))
+  t.same(got.map(String), ['0123456789', 'next'], 'small frame resumed')
+
+  /* larger than ibuf, read straight into its buffer */
+  const big = new Buffer(8000).fill('b')
+  raw(big.length, big.slice(0, 3000))
+  t.same(t.lib.tcprecvframes(cs, 10, 'u32', 20), [], 'half a large frame')
+  t.same(t.lib.tcprecvframes(cs, 10, 'u32', 20), [], 'still waiting')
+  t.lib.tcpsend(as, big.slice(3000))
+  t.lib.tcpsendframe(as, new Buffer('after'))
+  t.lib.tcpflush(as)
+  got = t.lib.tcprecvframes(cs, 10, 'u32', 100)
+  if (got.length < 2) got = got.concat(t.lib.tcprecvframes(cs, 10, 'u32', 100))
+  t.ok(got[0].equals(big), 'large frame resumed whole')
+  t.is(String(got[1]), 'after', 'next frame parsed')
+}
+
+function recvuntil (t) {
+  t.plan(5)
+
+  t.lib.tcpsend(as, new Buffer('GET / HTTP/1.1\r\nHost: x\r\n\r\nkey|val;'))
+  t.lib.tcpflush(as)
+
+  t.is(String(t.lib.tcprecvuntil(cs, 255, 100, '\r\n')), 'GET / HTTP/1.1\r\n',
+    'multi-byte delimiter')
+  t.is(String(t.lib.tcprecvuntil(cs, 255, 100, new Buffer('\r\n'))),
+    'Host: x\r\n', 'Buffer delimiter')
+  t.is(String(t.lib.tcprecvuntil(cs, 255, 100, ['\r\n', '|'])), '\r\n',
+    'earliest of a set')
+
+  t.throws(() => t.lib.tcprecvuntil(cs, 255, 100, ''), RangeError,
+    'empty delimiter throws')
+
+  t.lib.tcprecvuntil(cs, 255, function (buf, err) {
+    t.is(String(buf) + err, 'key|val;0', 'async delimiter set')
+  }, [';', 'x'])
+}
+
+function sendv (t) {
+  t.plan(5)
+
+  const big = new Buffer(8192).fill('v')
+  t.is(t.lib.tcpsendv(as, [new Buffer('a'), new Buffer('b')]), 2,
+    'small batch buffered')
+  t.is(t.lib.tcpsendv(as, [new Buffer('c'), big]), 8193, 'large batch gathered')
+  t.lib.tcpflush(as)
+
+  const got = t.lib.tcprecv(cs, 8195, 100)
+  t.is(String(got.slice(0, 4)) + got.length, 'abcv8195', 'order kept')
+
+  t.throws(() => t.lib.tcpsendv(as, [1, 'x']), TypeError,
+    'non-Buffer elements throw')
+  t.throws(() => t.lib.tcpsend(as, 'x'), TypeError, 'non-Buffer send throws')
+}
+
+function opts (t) {
+  t.plan(5)
+
+  const o = t.lib.tcpopts(as, { rcvbuf: 65536, sndbuf: 65536, buffered: false })
+  t.ok(o.rcvbuf >= 65536 && o.sndbuf >= 65536,
+    `kernel buffers rcvbuf: ${o.rcvbuf} sndbuf: ${o.sndbuf}`)
+  t.is(o.buffered, false, 'unbuffered mode')
+
+  /* no tcpflush needed */
+  t.is(t.lib.tcpsend(as, new Buffer('direct')), 6, 'unbuffered send')
+  t.is(String(t.lib.tcprecv(cs, 6, 100)), 'direct', 'sent without a flush')
+
+  /* a deadline partway through keeps what arrived */
+  t.lib.tcpopts(cs, { buffered: false })
+  t.lib.tcpsend(as, new Buffer('part'))
+  t.is(String(t.lib.tcprecv(cs, 8, 20)), 'part', 'unbuffered partial recv')
+
+  t.lib.tcpopts(as, { buffered: true })
+  t.lib.tcpopts(cs, { buffered: true })
+}
+
+function boxcache (t) {
+  t.plan(2)
+
+  t.lib.box_keypair()
+  const before = t.lib.box_cache()
+  t.is(before.size, 0, 'a new keypair empties the cache')
+
+  sz = t.lib.tcpsendstr(as, 'one') + t.lib.tcpsendstr(as, 'two')
+  t.lib.tcpflush(as)
+  t.lib.tcprecv(cs, sz)
+
+  const after = t.lib.box_cache()
+  t.same([after.size, after.misses - before.misses, after.hits - before.hits],
+    [1, 1, 1], 'beforenm once per peer')
+}
+
+function boxctx (t) {
+  t.plan(3)
+
+  const a = t.lib.box_context(), b = t.lib.box_context()
+  const apk = t.lib.getk(a).pk, bpk = t.lib.getk(b).pk
+  t.not(apk, bpk, 'each context has its own keypair')
+
+  /* each end of the connection seals with its own context */
+  t.lib.tcpbox(as, a)
+  t.lib.tcpbox(cs, b)
+  sz = t.lib.tcpsendstr(as, 'from a to b', bpk)
+  t.lib.tcpflush(as)
+  t.is(t.lib.tcprecvsecret(cs, sz, apk), 'from a to b', 'opened by b')
+  t.is(t.lib.box_cache(null, a).size, 1, 'shared key cached in a')
+
+  t.lib.tcpbox(as, null)
+  t.lib.tcpbox(cs, null)
+  t.lib.box_free(a)
+  t.lib.box_free(b)
+}
+
+function zerocopy (t) {
+  t.plan(7)
+  const fs = require('fs')
+  const file = '/tmp/mill-sendfile.txt'
+  fs.writeFileSync(file, '--static asset--')
+  const fd = fs.openSync(file, 'r')
+
+  sz = t.lib.tcpsendfile(as, fd, 2, 12)
+  t.is( String(t.lib.tcprecv(cs, sz)), 'static asset', 'tcpsendfile from offset' )
+  fs.closeSync(fd)
+  fs.unlinkSync(file)
+
+  /* cs proxies what as sends to a second connection */
+  const c2 = t.lib.tcpconnect(ipaddr)
+  const a2 = t.lib.tcpaccept(ls)
+  t.lib.tcpsend(as, new Buffer('proxied!'))
+  t.lib.tcpflush(as)
+  t.is( t.lib.tcpsplice(cs, c2, 8, 100), 8, 'tcpsplice moved 8 bytes' )
+  t.is( String(t.lib.tcprecv(a2, 8, 100)), 'proxied!', 'spliced bytes arrive' )
+
+  t.throws(() => t.lib.tcpsendfile(as, 0, -1, 1), RangeError,
+    'negative offset throws')
+  t.throws(() => t.lib.tcpsplice(cs, c2, -1), RangeError,
+    'negative len throws')
+
+  /* nobody reads a2, so the splice has to give up at its deadline; what it
+     took off c3 still reaches a2 once a2 reads and c2 flushes */
+  const c3 = t.lib.tcpconnect(ipaddr)
+  const a3 = t.lib.tcpaccept(ls)
+  t.lib.tcpopts(c2, { sndbuf: 4096 })
+  t.lib.tcpopts(a2, { rcvbuf: 4096 })
+  try {
+    t.lib.tcpsendv(c3, [new Buffer(1 << 20).fill('x')], 100)
+  } catch (err) {} /* whatever the buffers took is plenty */
+  const start = Date.now()
+  const moved = t.lib.tcpsplice(a3, c2, 1 << 20, 100)
+  t.ok( Date.now() - start < 1000, `tcpsplice kept its deadline, ${moved} moved` )
+
+  let got = 0
+  while (got < moved) {
+    t.lib.tcpflush(c2, 10)
+    const buf = t.lib.tcprecv(a2, 65536, 100)
+    if (!buf.length)
+      break
+    got += buf.length
+  }
+  t.is( got, moved, 'no spliced byte lost' )
+
+  t.lib.tcpclose(c3)
+  t.lib.tcpclose(a3)
+  t.lib.tcpclose(c2)
+  t.lib.tcpclose(a2)
+}
+
+function iostats (t) {
+  t.plan(6)
+  const i = {}
+  t.lib.statnames.forEach(function (name, n) { i[name] = n })
+
+  const before = t.lib.stats(as)
+  const total = t.lib.globalstats()
+  t.ok( before instanceof Float64Array, 'stats are a Float64Array' )
+
+  t.lib.tcpsend(as, new Buffer('counted'))
+  t.lib.tcpflush(as)
+  t.lib.tcprecv(cs, 7)
+  t.lib.tcprecv(cs, 1, 10)
+
+  const after = t.lib.stats(as)
+  t.is( after[i.bytesout] - before[i.bytesout], 7, 'bytes out counted' )
+  t.is( after[i.flushes] - before[i.flushes], 1, 'flush counted' )
+  t.is( t.lib.stats(cs)[i.partial] >= 1, true, 'deadline recv is partial' )
+  t.is( t.lib.globalstats()[i.bytesin] - total[i.bytesin], 7,
+    'bytes in added to the totals' )
+  t.is( t.lib.stats(new Buffer(8))[i.sends], 0, 'unknown socket is all 0' )
+}
+
+function histograms (t) {
+  t.plan(4)
+  const bounds = t.lib.histbounds()
+  const n = bounds.length
+
+  function count (h, name) {
+    const row = t.lib.histnames.indexOf(name) * n
+    var c = 0
+    for (var i = 0; i < n; i++) c += h[row + i]
+    return c
+  }
+
+  t.lib.histograms()
+  t.lib.histsample(1)
+  t.lib.tcpsend(as, new Buffer('timed'))
+  t.lib.tcpflush(as)
+  t.lib.tcprecv(cs, 5)
+  t.lib.histsample(0)
+  t.lib.tcpflush(as)
+
+  const h = t.lib.histograms()
+  t.is( h.length, t.lib.histnames.length * n, 'one row of buckets per call' )
+  t.is( count(h, 'tcprecv'), 1, 'tcprecv recorded' )
+  t.is( count(h, 'tcpflush'), 1, 'only the sampled flush recorded' )
+  t.is( count(t.lib.histograms(), 'tcprecv'), 0, 'snapshot resets' )
+}
+
+function timeouts (t) {
+  t.plan(4)
+  const ETIMEDOUT = require('os').constants.errno.ETIMEDOUT
+  const start = Date.now()
+
+  /* the wheel's uv timer is unref'd, keep the loop alive for the test */
+  const hold = setTimeout(function () {}, 1000)
+
+  t.lib.tcptimeouts(cs, 40, 20, 0, function () {
+    t.lib.tcptimeouts(cs)
+    clearTimeout(hold)
+    t.ok( Date.now() - start >= 40, 'onidle once idle for 40ms' )
+  })
+
+  t.lib.tcprecv(cs, 4, function (buf, err) {
+    t.is( err, ETIMEDOUT, 'pending recv timed out' )
+    t.is( buf.length, 0, 'nothing arrived' )
+    t.ok( Date.now() - start >= 15, 'after the read timeout' )
+  })
+}
+
 function sendstr (t) {
   t.plan(1)
 
@@ -63,3 +405,20 @@ function sendstr (t) {
 
   t.lib.tcpclose(as)
 }
+
+function reuseport (t) {
+  t.plan(4)
+
+  const addr = t.lib.iplocal(44450)
+  const a = t.lib.tcplisten(addr, 10, { reuseport: true })
+  const b = t.lib.tcplisten(addr, 10, { reuseport: true })
+
+  t.ok( Buffer.isBuffer(a) && Buffer.isBuffer(b), 'two listeners on one port' )
+  t.is( t.lib.tcpport(a), 44450, 'first listener port ' + t.lib.tcpport(a) )
+  t.is( t.lib.tcpport(b), 44450, 'second listener port ' + t.lib.tcpport(b) )
+  t.throws( () => t.lib.tcplisten(addr, 10, {}), /EADDRINUSE/,
+    'a listener without reuseport throws' )
+
+  t.lib.tcpclose(a)
+  t.lib.tcpclose(b)
+}
@@ -0,0 +1,118 @@
+const net = require('net')
+
+module.exports  = thread
+
+function thread (t) {
+  t.test( 'scheduler thread echo', echo )
+  t.test( 'coroutine snapshot', costats )
+  t.test( 'stuck peer gets drops', drops )
+}
+
+/* while the scheduler thread runs, the JS side uses node's own sockets */
+function echo (t) {
+  t.plan(6)
+
+  const OPEN = 1, DATA = 2, CLOSE = 3
+  const port = 44449
+  const msg = 'echo from the scheduler thread'
+
+  const h = t.lib.threadlisten(t.lib.iplocal(port), 10, 4096,
+    function (type, id, buf) {
+      if (type === OPEN)
+        t.ok( id, `connection opened, id: ${id}` )
+      if (type === DATA)
+        t.ok( t.lib.threadsend(h, id, buf), `queued echo of ${buf.length} bytes` )
+      if (type === CLOSE) {
+        t.pass( 'connection closed' )
+        t.lib.threadstop(h)
+      }
+    })
+
+  t.throws( () => t.lib.tcprecv(h, 16, 10), /scheduler thread/,
+    'blocking recv throws while the thread runs' )
+  t.throws( () => t.lib.chanmake(1), /scheduler thread/,
+    'chanmake throws while the thread runs' )
+
+  /* give the thread a moment to bind */
+  setTimeout(function () {
+    const c = net.connect(port, '127.0.0.1', () => c.write(msg))
+    c.on('data', function (buf) {
+      t.is( String(buf), msg, `echo: ${buf}` )
+      c.end()
+    })
+  }, 50)
+}
+
+function costats (t) {
+  t.plan(6)
+
+  const DATA = 2, CLOSE = 3
+  const FIELDS = 8, KIND = 0, STATE = 1, FD = 2, ID = 7
+  const port = 44453
+  const lib = t.lib
+  const states = lib.costates.length
+
+  function kinds (v) {
+    const seen = {}
+    for (let i = states; i < v.length; i += FIELDS)
+      seen[lib.cokinds[v[i + KIND]]] = v.slice(i, i + FIELDS)
+    return seen
+  }
+
+  const h = lib.threadlisten(lib.iplocal(port), 10, 4096,
+    function (type, id, buf) {
+      if (type === DATA) {
+        const v = lib.costats()
+        const seen = kinds(v)
+        t.deepEqual( Object.keys(seen).sort(),
+          [ 'accept', 'dispatch', 'reader', 'writer' ], 'every kind listed' )
+        t.is( seen.reader[ID], id, 'reader carries the connection id' )
+        t.is( lib.costates[seen.writer[STATE]], 'chwait',
+          'idle writer waits on its channel' )
+        t.ok( seen.accept[FD] >= 0, 'accept loop waits on the listener' )
+        lib.threadclose(h, id)
+      }
+      if (type === CLOSE) {
+        lib.threadstop(h)
+        const v = lib.costats()
+        t.is( v.length, states, 'nothing left after threadstop' )
+        t.is( v.reduce((a, b) => a + b, 0), 0, 'no coroutine counted' )
+      }
+    })
+
+  setTimeout(function () {
+    const c = net.connect(port, '127.0.0.1', () => c.write('ping'))
+    c.on('data', () => {})
+  }, 50)
+}
+
+/* a peer that never reads fills its writer, the rest comes back as drops */
+function drops (t) {
+  t.plan(2)
+
+  const OPEN = 1, CLOSE = 3, DROP = 5
+  const port = 44454
+  const big = new Buffer(64 * 1024)
+  let c, dropped = false
+
+  const h = t.lib.threadlisten(t.lib.iplocal(port), 10, 4096,
+    function (type, id, buf) {
+      if (type === OPEN)
+        for (let i = 0; i < 1024; i++)
+          t.lib.threadsend(h, id, big)
+      if (type === DROP && !dropped) {
+        dropped = true
+        t.is( buf.length, big.length, 'dropped msg handed back' )
+        c.destroy()
+      }
+      if (type === CLOSE) {
+        t.ok( dropped, 'closed after the drop' )
+        t.lib.threadstop(h)
+      }
+    })
+
+  setTimeout(function () {
+    c = net.connect(port, '127.0.0.1')
+    c.pause()
+  }, 50)
+}
@@ -1,5 +1,7 @@
 module.exports = function udp (t) {
   t.test('udp msgs', listen)
+  t.test('udp batched recv', batch)
+  t.test('udp batched send', sendmany)
 }
 
 function listen (t) {
@@ -41,3 +43,74 @@ function listen (t) {
 
   t.ok(validator, `total message loss: ${bufferLoss.length}`)
 }
+
+function batch (t) {
+  t.plan(5)
+
+  const buf = new Buffer('Hello, batch!')
+  const ipaddr = t.lib.iplocal(44446)
+  const ls = t.lib.udplisten(ipaddr)
+
+  var total = 64, recvd = 0, lost = 0, calls = 0, addr
+
+  var h = t.lib.udprecv(ls, 13, function (batch) {
+    calls++
+    for (var i = 0; i < batch.lengths.length; i++) {
+      var off = batch.offsets[i]
+      if (String(batch.buf.slice(off, off + batch.lengths[i])) !== String(buf))
+        lost++
+      addr = t.lib.ipaddrstr(batch.addrs, i)
+    }
+    recvd += batch.lengths.length
+    if (recvd < total)
+      return
+
+    t.is(recvd, total, `total batched udp msgs recv'd: ${recvd}`)
+    t.is(lost, 0, `total message loss: ${lost}`)
+    t.ok(calls <= total, `${calls} callbacks for ${recvd} msgs`)
+    t.is(addr, '127.0.0.1', 'confirmed localhost addrstr: 127.0.0.1')
+    t.is(batch.addrs.length, batch.lengths.length * 32, 'addrs table size')
+
+    t.lib.udprecvstop(h)
+    t.lib.udpclose(ls)
+  }, 32)
+
+  var i = total
+  while (i--)
+    t.lib.udpsend(ls, ipaddr, buf)
+}
+
+function sendmany (t) {
+  t.plan(6)
+
+  const buf = new Buffer('Hello, burst!')
+  const tail = new Buffer('tail')
+  const ipaddr = t.lib.iplocal(44447)
+  const ls = t.lib.udplisten(ipaddr)
+
+  /* same-destination burst with a short last datagram */
+  var msgs = [], i = 16
+  while (i--)
+    msgs.push(ipaddr, buf)
+  msgs.push(ipaddr, tail)
+
+  const sent = t.lib.udpsendmany(ls, msgs)
+  t.is(sent, 17, `udpsendmany sent ${sent} datagrams`)
+  t.is(t.lib.stats(ls)[t.lib.statnames.indexOf('sends')], 17,
+    'udp socket stats found by fd')
+
+  var got = []
+  for (i = 0; i < sent; i++)
+    got.push(String(t.lib.udprecv(ls, 64, 100).buf))
+
+  t.is(got.join(''), String(buf).repeat(16) + String(tail),
+    'datagram boundaries and order kept')
+
+  t.is(t.lib.udpsendmany(ls, []), 0, 'nothing to send')
+  t.throws(() => t.lib.udpsendmany(ls, [ipaddr]), RangeError,
+    'addr without a buf')
+  t.throws(() => t.lib.udpsendmany(ls, [ipaddr, 'str']), TypeError,
+    'buf that is not a Buffer')
+
+  t.lib.udpclose(ls)
+}
@@ -0,0 +1,112 @@
+module.exports = function unix (t) {
+  t.test('unix deadlines', deadlines)
+  t.test('unix async accept, send and recv', async)
+  t.test('unix fd passing', sendfd)
+  if (process.platform === 'linux')
+    t.test('unix shared memory rings', shm)
+}
+
+var path = '/tmp/mill-test.sock'
+
+function deadlines (t) {
+  t.plan(2)
+  var ls = t.lib.unixlisten(path)
+  t.is( t.lib.unixaccept(ls, 10), null, 'accept returns null on deadline' )
+
+  var cs = t.lib.unixconnect(path)
+  var as = t.lib.unixaccept(ls, 10)
+  t.is( t.lib.unixrecv(cs, 4, 10).length, 0, 'recv returns nothing on deadline' )
+
+  t.lib.unixclose(cs)
+  t.lib.unixclose(as)
+  t.lib.unixclose(ls)
+}
+
+function async (t) {
+  t.plan(4)
+  var ls = t.lib.unixlisten(path)
+
+  var h = t.lib.unixaccept(ls, function (as) {
+    t.lib.unixacceptstop(h)
+    t.lib.unixrecvuntil(as, 255, function (buf, err) {
+      t.is( String(buf), 'ping\r', 'async recvuntil on the accepted socket' )
+      t.lib.unixsend(as, new Buffer('pong'), function (sz, err) {
+        t.is( sz, 4, 'async send' )
+        t.lib.unixflush(as, function (err) {
+          t.lib.unixclose(as)
+        })
+      })
+    })
+  })
+
+  var cs = t.lib.unixconnect(path)
+  t.lib.unixsend(cs, new Buffer('ping\r'), 10)
+  t.lib.unixflush(cs, 10)
+
+  t.lib.unixrecv(cs, 4, function (buf, err) {
+    t.is( String(buf), 'pong', 'async recv' )
+    t.is( err, 0, 'no error' )
+    t.lib.unixclose(cs)
+    t.lib.unixclose(ls)
+  })
+}
+
+function sendfd (t) {
+  t.plan(3)
+  var ls = t.lib.unixlisten(path)
+  var us = t.lib.unixconnect(path)
+  var uas = t.lib.unixaccept(ls, 100)
+
+  var tls = t.lib.tcplisten(t.lib.iplocal(44452))
+  var cs = t.lib.tcpconnect(t.lib.iplocal(44452))
+  var as = t.lib.tcpaccept(tls)
+
+  t.lib.unixsendfd(us, as, 100)
+  t.lib.tcpclose(as)
+  var fd = t.lib.unixrecvfd(uas, 100)
+  t.is( typeof fd, 'number', 'received a fd' )
+
+  var ws = t.lib.tcpwrap(fd)
+  t.lib.tcpsend(cs, new Buffer('handoff'))
+  t.lib.tcpflush(cs)
+  t.is( String(t.lib.tcprecv(ws, 7, 100)), 'handoff', 'wrapped sock reads' )
+  t.is( t.lib.unixrecvfd(uas, 10), null, 'recvfd returns null on deadline' )
+
+  t.lib.tcpclose(ws)
+  t.lib.tcpclose(cs)
+  t.lib.tcpclose(tls)
+  t.lib.unixclose(uas)
+  t.lib.unixclose(us)
+  t.lib.unixclose(ls)
+}
+
+function shm (t) {
+  t.plan(5)
+  var ls = t.lib.unixlisten(path)
+  var cs = t.lib.unixconnect(path)
+  var as = t.lib.unixaccept(ls, 100)
+
+  var a = t.lib.shmconnect(cs, 65536, 100)
+  var b = t.lib.shmaccept(as, 100)
+
+  t.lib.shmsend(a, [new Buffer('hello '), new Buffer('ring\r')])
+  t.is( t.lib.shmrecv(b, 4, 10).length, 0, 'nothing before the flush' )
+  t.lib.shmflush(a)
+  t.is( String(t.lib.shmrecv(b, 6, 10)), 'hello ', 'shmrecv' )
+  t.is( String(t.lib.shmrecvuntil(b, 255, 10)), 'ring\r', 'shmrecvuntil' )
+
+  var big = new Buffer(200000)
+  for (var i = 0; i < big.length; i++) big[i] = i & 0xff
+  t.lib.shmsend(b, big.slice(0, 65536), 100)
+  t.lib.shmflush(b)
+  t.is( t.lib.shmrecv(a, 65536, 100).equals(big.slice(0, 65536)), true,
+    'a full ring comes through' )
+
+  t.lib.shmclose(a)
+  t.is( t.lib.shmrecv(b, 4, 100).length, 0, 'nothing after the peer closed' )
+
+  t.lib.shmclose(b)
+  t.lib.unixclose(cs)
+  t.lib.unixclose(as)
+  t.lib.unixclose(ls)
+}
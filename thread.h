@@ -0,0 +1,477 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Scheduler thread                                                          */
+/******************************************************************************/
+
+/* threadlisten() starts a native thread that owns a tcp listener and runs the
+   libmill scheduler: one coroutine accepts, every connection gets a reader
+   and a writer coroutine. The thread and JS talk through two single-producer
+   single-consumer rings. The thread wakes JS with uv_async_send, JS wakes the
+   thread through a pipe its dispatcher coroutine waits on, and neither side
+   makes a syscall while the other one is busy.
+
+   libmill keeps one scheduler per process, so there is one scheduler thread
+   at a time, and while it runs the JS thread must stick to the async
+   (callback) calls, which do not enter libmill. The others throw, see
+   MILL_GUARD. */
+
+#define RING_SIZE 4096 /* power of two */
+
+struct ring {
+  void *slots[RING_SIZE];
+  size_t head; /* consumer side */
+  char pad[64];
+  size_t tail; /* producer side */
+};
+
+static int ring_push(struct ring *r, void *p) {
+  size_t t = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+    return 0;
+  r->slots[t & (RING_SIZE - 1)] = p;
+  __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void *ring_pop(struct ring *r) {
+  size_t h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  if (h == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  void *p = r->slots[h & (RING_SIZE - 1)];
+  __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+  return p;
+}
+
+static int ring_empty(struct ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+    __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* message types, also the first param of the threadlisten callback */
+#define THREAD_OPEN 1
+#define THREAD_DATA 2
+#define THREAD_CLOSE 3
+#define THREAD_ERROR 4
+#define THREAD_DROP 5  /* a msg the connection's writer had no room for */
+
+struct thread_msg {
+  int type;
+  uint64_t id;  /* connection generation << 32 | fd */
+  char *data;
+  size_t len;
+};
+
+struct thread_conn {
+  uint32_t gen;
+  chan out;  /* NULL once the reader winds down */
+  int open;  /* fd still ours, until the reader closes it */
+};
+
+typedef struct thread_s {
+  uv_async_t async; /* first, the handle casts back */
+  uv_thread_t thread;
+  Callback *cb;
+
+  ipaddr addr;
+  int backlog;
+  size_t rcvbuf;
+
+  int wakefd[2];
+  int sleeping;
+  int stop;
+  int dispatching;
+
+  struct ring out; /* thread -> JS */
+  struct ring in;  /* JS -> thread */
+
+  /* owned by the scheduler thread */
+  struct thread_conn *conns;
+  size_t nconns;
+  size_t live;
+  uint32_t gen;
+} thread_t;
+
+/* scheduler side: hand a message to JS, waiting while the ring is full */
+static void thread_emit(thread_t *t, struct co *co, int type, uint64_t id,
+  char *data, size_t len) {
+  struct thread_msg *m = (struct thread_msg *)malloc(sizeof *m);
+  assert(m);
+  m->type = type;
+  m->id = id;
+  m->data = data;
+  m->len = len;
+  while (!ring_push(&t->out, m)) {
+    uv_async_send(&t->async);
+    co_park(co, CO_SLEEP, -1, 0, now() + 1);
+    msleep(now() + 1);
+    co_resume(co);
+  }
+  uv_async_send(&t->async);
+}
+
+static struct thread_conn *thread_conn_get(thread_t *t, uint64_t id) {
+  size_t fd = id & 0xffffffff;
+  if (fd >= t->nconns || !t->conns[fd].out ||
+      t->conns[fd].gen != (uint32_t)(id >> 32))
+    return NULL;
+  return &t->conns[fd];
+}
+
+/* read whatever is available, from ibuf first, like the async tcp path */
+static ssize_t thread_recv(struct co *co, struct mill_tcpconn *conn, char *buf,
+  size_t len) {
+  if (conn->ilen > 0) {
+    size_t n = conn->ilen < len ? conn->ilen : len;
+    memcpy(buf, conn->ibuf + conn->ifirst, n);
+    conn->ifirst += n;
+    conn->ilen -= n;
+    return n;
+  }
+  for (;;) {
+    ssize_t sz = recv(conn->fd, buf, len, 0);
+    if (sz >= 0)
+      return sz;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    co_park(co, CO_FDWAIT, conn->fd, FDW_IN, -1);
+    fdwait(conn->fd, FDW_IN, -1);
+    co_resume(co);
+  }
+}
+
+/* write all of buf, parked only while the socket is full. The writer never
+   goes through tcpsend, so nothing waits in libmill's obuf. The waits are
+   short so a writer stuck on a peer still notices threadstop(). */
+static int thread_send(thread_t *t, struct co *co, int fd, const char *buf,
+  size_t len) {
+  while (len) {
+    ssize_t sz = send(fd, buf, len, STREAM_NOSIGNAL);
+    if (sz >= 0) {
+      buf += sz;
+      len -= sz;
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    int64_t deadline = now() + 100;
+    co_park(co, CO_FDWAIT, fd, FDW_OUT, deadline);
+    int ev = fdwait(fd, FDW_OUT, deadline);
+    co_resume(co);
+    if (!ev && __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+      errno = ECANCELED;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+coroutine void thread_writer(thread_t *t, tcpsock s, chan out, chan done,
+  uint64_t id) {
+  int fd = ((struct mill_tcpconn *)s)->fd;
+  struct co co;
+  co_add(&co, CO_WRITER, id);
+
+  for (;;) {
+    co_park(&co, CO_CHWAIT, -1, 0, -1);
+    struct thread_msg *m = chr(out, struct thread_msg *);
+    co_resume(&co);
+    if (!m)
+      break;
+
+    /* on close the reader sees eof and tears the connection down */
+    if (m->type == THREAD_CLOSE)
+      shutdown(fd, SHUT_RDWR);
+    else
+      thread_send(t, &co, fd, m->data, m->len);
+    free(m->data);
+    free(m);
+  }
+  co_remove(&co);
+  chs(done, int, 1);
+}
+
+coroutine void thread_reader(thread_t *t, tcpsock s) {
+  struct mill_tcpconn *conn = (struct mill_tcpconn *)s;
+  int fd = conn->fd;
+
+  if ((size_t)fd >= t->nconns) {
+    size_t n = fd * 2 + 64;
+    t->conns = (struct thread_conn *)realloc(t->conns, n * sizeof *t->conns);
+    assert(t->conns);
+    memset(t->conns + t->nconns, 0, (n - t->nconns) * sizeof *t->conns);
+    t->nconns = n;
+  }
+
+  chan out = chmake(struct thread_msg *, 64);
+  chan done = chmake(int, 0);
+  uint32_t gen = ++t->gen;
+  uint64_t id = ((uint64_t)gen << 32) | (uint32_t)fd;
+  t->conns[fd].gen = gen;
+  t->conns[fd].out = out;
+  t->conns[fd].open = 1;
+  t->live++;
+
+  struct co co;
+  co_add(&co, CO_READER, id);
+  go(thread_writer(t, s, out, done, id));
+  thread_emit(t, &co, THREAD_OPEN, id, NULL, 0);
+
+  for (;;) {
+    char *buf = (char *)malloc(t->rcvbuf);
+    assert(buf);
+    ssize_t sz = thread_recv(&co, conn, buf, t->rcvbuf);
+    if (sz <= 0) {
+      free(buf);
+      break;
+    }
+    thread_emit(t, &co, THREAD_DATA, id, buf, sz);
+  }
+
+  /* let the writer finish what JS queued before closing */
+  t->conns[fd].out = NULL;
+  chs(out, struct thread_msg *, NULL);
+  co_park(&co, CO_CHWAIT, -1, 0, -1);
+  (void)chr(done, int);
+  co_resume(&co);
+  chclose(out);
+  chclose(done);
+  t->conns[fd].open = 0;
+  tcpclose(s);
+
+  /* the emit may still park, so the record goes only after it */
+  thread_emit(t, &co, THREAD_CLOSE, id, NULL, 0);
+  co_remove(&co);
+  t->live--;
+}
+
+/* hands m to a writer without waiting, 0 when its channel is full */
+static int thread_offer(chan out, struct thread_msg *m) {
+  char clause[CHAN_CLAUSELEN];
+
+  mill_choose_init_(MILL_HERE_);
+  mill_choose_out_(clause, out, &m, sizeof m, 0);
+  mill_choose_otherwise_();
+  return mill_choose_wait_() == 0;
+}
+
+/* Routes JS messages to the connection writers. One peer that stops reading
+   fills only its own writer's channel; what does not fit goes back to JS as
+   THREAD_DROP with its data, so the other connections keep flowing. */
+coroutine void thread_dispatch(thread_t *t) {
+  char drain[64];
+  struct co co;
+  co_add(&co, CO_DISPATCH, 0);
+
+  while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+    struct thread_msg *m;
+    while ((m = (struct thread_msg *)ring_pop(&t->in))) {
+      struct thread_conn *c = thread_conn_get(t, m->id);
+      if (!c) {
+        free(m->data);
+        free(m);
+        continue;
+      }
+      if (!thread_offer(c->out, m)) {
+        thread_emit(t, &co, THREAD_DROP, m->id, m->data, m->len);
+        free(m);
+      }
+    }
+
+    /* announce the nap, then look once more so a push can't slip between */
+    __atomic_store_n(&t->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (ring_empty(&t->in)) {
+      int64_t deadline = now() + 100;
+      co_park(&co, CO_FDWAIT, t->wakefd[0], FDW_IN, deadline);
+      fdwait(t->wakefd[0], FDW_IN, deadline);
+      co_resume(&co);
+    }
+    __atomic_store_n(&t->sleeping, 0, __ATOMIC_SEQ_CST);
+    while (read(t->wakefd[0], drain, sizeof drain) > 0);
+  }
+  co_remove(&co);
+  t->dispatching = 0;
+}
+
+static void thread_main(void *arg) {
+  thread_t *t = (thread_t *)arg;
+  struct co co;
+  co_add(&co, CO_ACCEPT, 0);
+
+  tcpsock ls = tcplisten(t->addr, t->backlog);
+  if (!ls) {
+    thread_emit(t, &co, THREAD_ERROR, errno, NULL, 0);
+    co_remove(&co);
+    return;
+  }
+
+  t->dispatching = 1;
+  go(thread_dispatch(t));
+
+  /* the deadline lets the accept loop notice threadstop() */
+  while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+    int64_t deadline = now() + 100;
+    co_park(&co, CO_FDWAIT, tcpfd(ls), FDW_IN, deadline);
+    int ev = fdwait(tcpfd(ls), FDW_IN, deadline);
+    co_resume(&co);
+    if (!(ev & FDW_IN))
+      continue;
+    tcpsock as = tcpaccept(ls, 0);
+    if (as)
+      go(thread_reader(t, as));
+  }
+  tcpclose(ls);
+
+  /* wind down every connection still open, readers close them on eof and
+     writers fail their sends. no coroutine may outlive the thread, the next
+     one inherits the scheduler */
+  for (size_t fd = 0; fd < t->nconns; fd++)
+    if (t->conns[fd].open)
+      shutdown(fd, SHUT_RDWR);
+  while (t->live || t->dispatching) {
+    co_park(&co, CO_SLEEP, -1, 0, now() + 10);
+    msleep(now() + 10);
+    co_resume(&co);
+  }
+  co_remove(&co);
+  free(t->conns);
+}
+
+static void thread_drain(uv_async_t *handle) {
+  HandleScope scope;
+  thread_t *t = (thread_t *)handle;
+  struct thread_msg *m;
+
+  while ((m = (struct thread_msg *)ring_pop(&t->out))) {
+    Local<Value> buf = Nan::Null();
+    if (m->data)
+      buf = NewBuffer(m->data, m->len).ToLocalChecked();
+
+    Local<Value> argv[] = { New<Number>(m->type), New<Number>((double)m->id),
+      buf };
+    free(m);
+    t->cb->Call(3, argv);
+  }
+}
+
+static void thread_free(uv_handle_t *handle) {
+  thread_t *t = (thread_t *)handle;
+  struct thread_msg *m;
+  while ((m = (struct thread_msg *)ring_pop(&t->in))) {
+    free(m->data);
+    free(m);
+  }
+  close(t->wakefd[0]);
+  close(t->wakefd[1]);
+  delete t->cb;
+  free(t);
+}
+
+//api: threadlisten(ipaddr, backlog, rcvbuf, cb(type, id, buf))
+NAN_METHOD(threadlisten){
+  if (thread_running)
+    return Nan::ThrowError("a scheduler thread is already running");
+
+  thread_t *t = (thread_t *)calloc(1, sizeof(thread_t));
+  assert(t);
+  t->addr = *UnwrapPointer<ipaddr*>(info[0]);
+  t->backlog = info[1]->IsNumber() ? To<int>(info[1]).FromJust() : 10;
+  t->rcvbuf = info[2]->IsNumber() ? To<uint32_t>(info[2]).FromJust() : 4096;
+  t->cb = new Callback(info[3].As<Function>());
+
+  int rc = pipe(t->wakefd);
+  assert(rc == 0);
+  for (int i = 0; i < 2; i++) {
+    int opt = fcntl(t->wakefd[i], F_GETFL, 0);
+    fcntl(t->wakefd[i], F_SETFL, opt | O_NONBLOCK);
+  }
+
+  uv_async_init(uv_default_loop(), &t->async, thread_drain);
+  rc = uv_thread_create(&t->thread, thread_main, t);
+  assert(rc == 0);
+  thread_running = 1;
+
+  ret(WrapPointer(t, sizeof(thread_t)));
+}
+
+static void thread_wake(thread_t *t) {
+  if (__atomic_exchange_n(&t->sleeping, 0, __ATOMIC_SEQ_CST)) {
+    ssize_t rc = write(t->wakefd[1], "", 1);
+    (void)rc;
+  }
+}
+
+static bool thread_post(thread_t *t, int type, double id, char *data,
+  size_t len) {
+  struct thread_msg *m = (struct thread_msg *)malloc(sizeof *m);
+  assert(m);
+  m->type = type;
+  m->id = (uint64_t)id;
+  m->data = data;
+  m->len = len;
+  if (!ring_push(&t->in, m)) {
+    free(m);
+    return false;
+  }
+  thread_wake(t);
+  return true;
+}
+
+/* queue a msg for a connection, false when the ring is full */
+NAN_METHOD(threadsend){
+  thread_t *t = UnwrapPointer<thread_t *>(info[0]);
+  double id = To<double>(info[1]).FromJust();
+  size_t len = node::Buffer::Length(info[2]);
+
+  char *data = (char *)malloc(len ? len : 1);
+  assert(data);
+  memcpy(data, node::Buffer::Data(info[2]), len);
+
+  bool ok = thread_post(t, THREAD_DATA, id, data, len);
+  if (!ok)
+    free(data);
+  ret(New<Boolean>(ok));
+}
+
+/* close a connection once its queued msgs are flushed */
+NAN_METHOD(threadclose){
+  thread_t *t = UnwrapPointer<thread_t *>(info[0]);
+  double id = To<double>(info[1]).FromJust();
+  ret(New<Boolean>(thread_post(t, THREAD_CLOSE, id, NULL, 0)));
+}
+
+/* stop accepting, close every connection and join the thread */
+NAN_METHOD(threadstop){
+  thread_t *t = UnwrapPointer<thread_t *>(info[0]);
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->sleeping, 1, __ATOMIC_SEQ_CST);
+  thread_wake(t);
+  uv_thread_join(&t->thread);
+  thread_running = 0;
+
+  /* the close events still waiting in the ring */
+  thread_drain(&t->async);
+  uv_close((uv_handle_t *)&t->async, thread_free);
+}
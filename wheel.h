@@ -0,0 +1,254 @@
+/*
+
+  Copyright (c) 2016 Bent Cardan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/******************************************************************************/
+/*  Timer wheel                                                               */
+/******************************************************************************/
+
+/* Timeouts of the async sockets share one uv timer. Timers hang off a
+   hierarchical wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots, level l
+   slot spans 64^l ms, so adding and cancelling are a list link and unlink,
+   and a slot that comes due fires all of its timers in one pass. Timers on
+   the upper levels move down a level when their slot comes up. The uv timer
+   is only set for the next occupied slot and never holds the loop open. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4  /* 64^4 ms, about 4.6 hours, longer ones go around */
+
+struct wtimer {
+  struct wtimer *prev, *next;
+  uint64_t due;  /* uv_now() ms */
+  int armed;
+  int level;
+  int slot;
+  void (*fire)(struct wtimer *);
+  void *data;
+};
+
+static struct {
+  uv_timer_t timer;
+  int init;
+  uint64_t now;    /* every slot before this has fired */
+  uint64_t armed;  /* when the uv timer goes off, 0 when it is stopped */
+  size_t n;
+  uint64_t occupied[WHEEL_LEVELS];
+  struct wtimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel;
+
+static void wheel_place(struct wtimer *t) {
+  uint64_t delta = t->due > wheel.now ? t->due - wheel.now : 0;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+      delta >> (WHEEL_BITS * (level + 1)))
+    level++;
+
+  /* past the top level: park it in the top slot that comes up last */
+  uint64_t at = t->due;
+  if (delta >> (WHEEL_BITS * WHEEL_LEVELS))
+    at = wheel.now;
+
+  int slot = (at >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  t->level = level;
+  t->slot = slot;
+  t->prev = NULL;
+  t->next = wheel.slots[level][slot];
+  if (t->next)
+    t->next->prev = t;
+  wheel.slots[level][slot] = t;
+  wheel.occupied[level] |= (uint64_t)1 << slot;
+  t->armed = 1;
+  wheel.n++;
+}
+
+static void wheel_unlink(struct wtimer *t) {
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    wheel.slots[t->level][t->slot] = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  if (!wheel.slots[t->level][t->slot])
+    wheel.occupied[t->level] &= ~((uint64_t)1 << t->slot);
+  t->armed = 0;
+  wheel.n--;
+}
+
+/* start of the next occupied slot on any level, UINT64_MAX when empty */
+static uint64_t wheel_next() {
+  uint64_t next = UINT64_MAX;
+  for (int l = 0; l < WHEEL_LEVELS; l++) {
+    uint64_t occ = wheel.occupied[l];
+    if (!occ)
+      continue;
+    int shift = WHEEL_BITS * l;
+    int r = (((wheel.now >> shift) & WHEEL_MASK) + 1) & WHEEL_MASK;
+    if (r)
+      occ = occ >> r | occ << (64 - r);
+    uint64_t at = ((wheel.now >> shift) + __builtin_ctzll(occ) + 1) << shift;
+    if (at < next)
+      next = at;
+  }
+  return next;
+}
+
+/* fires everything due up to target, skipping the empty slots */
+static void wheel_advance(uint64_t target) {
+  for (;;) {
+    uint64_t next = wheel_next();
+    if (next > target) {
+      if (wheel.now < target)
+        wheel.now = target;
+      return;
+    }
+    wheel.now = next;
+
+    /* top down, a timer may drop several levels at once */
+    for (int l = WHEEL_LEVELS - 1; l > 0; l--) {
+      int shift = WHEEL_BITS * l;
+      if (wheel.now & (((uint64_t)1 << shift) - 1))
+        continue;
+      int slot = (wheel.now >> shift) & WHEEL_MASK;
+      struct wtimer *t = wheel.slots[l][slot];
+      wheel.slots[l][slot] = NULL;
+      wheel.occupied[l] &= ~((uint64_t)1 << slot);
+
+      /* timers past the top level land back in this very slot */
+      while (t) {
+        struct wtimer *next = t->next;
+        wheel.n--;
+        wheel_place(t);
+        t = next;
+      }
+    }
+
+    /* a fire cb may add or cancel timers, this slot included */
+    struct wtimer **head = &wheel.slots[0][wheel.now & WHEEL_MASK];
+    while (*head) {
+      struct wtimer *t = *head;
+      wheel_unlink(t);
+      t->fire(t);
+    }
+  }
+}
+
+static void wheel_tick(uv_timer_t *handle);
+
+static void wheel_arm() {
+  uint64_t next = wheel_next();
+  if (next == UINT64_MAX) {
+    uv_timer_stop(&wheel.timer);
+    wheel.armed = 0;
+    return;
+  }
+  if (wheel.armed && wheel.armed <= next)
+    return;
+
+  uint64_t t = uv_now(uv_default_loop());
+  uv_timer_start(&wheel.timer, wheel_tick, next > t ? next - t : 0, 0);
+  wheel.armed = next;
+}
+
+static void wheel_tick(uv_timer_t *handle) {
+  HandleScope scope;
+  wheel.armed = 0;
+  wheel_advance(uv_now(handle->loop));
+  wheel_arm();
+}
+
+/* (re)starts t to fire in ms */
+static void wheel_add(struct wtimer *t, uint64_t ms) {
+  if (!wheel.init) {
+    uv_timer_init(uv_default_loop(), &wheel.timer);
+    uv_unref((uv_handle_t *)&wheel.timer);
+    wheel.init = 1;
+  }
+  if (t->armed)
+    wheel_unlink(t);
+
+  /* nothing to catch up with on an empty wheel */
+  uint64_t t0 = uv_now(uv_default_loop());
+  if (!wheel.n)
+    wheel.now = t0;
+
+  t->due = t0 + ms > wheel.now ? t0 + ms : wheel.now + 1;
+  wheel_place(t);
+  if (!wheel.armed || t->due < wheel.armed)
+    wheel_arm();
+}
+
+/* the uv timer is left alone, a wakeup for nothing is cheaper than a
+   restart on every cancel */
+static void wheel_cancel(struct wtimer *t) {
+  if (t->armed)
+    wheel_unlink(t);
+}
+
+/* Idle timeouts. Activity only stamps active, the timer notices it when it
+   fires and goes back to sleep for the rest of the period, so a busy socket
+   costs no timer upkeep at all and an idle one a wakeup per period. */
+struct idle {
+  struct wtimer timer; /* first, the timer casts back */
+  uint32_t ms;
+  uint64_t active;
+  Callback *cb;
+};
+
+static inline void idle_touch(struct idle *i) {
+  if (i->ms)
+    i->active = uv_now(uv_default_loop());
+}
+
+static void idle_fire(struct wtimer *w) {
+  struct idle *i = (struct idle *)w;
+  uint64_t t = uv_now(uv_default_loop());
+  if (t - i->active < i->ms) {
+    wheel_add(w, i->active + i->ms - t);
+    return;
+  }
+  i->active = t;
+  wheel_add(w, i->ms);
+
+  /* may close the socket, which cancels the timer */
+  i->cb->Call(0, NULL);
+}
+
+/* ms 0 or no cb turns it off */
+static void idle_set(struct idle *i, uint32_t ms, Local<Value> cb) {
+  wheel_cancel(&i->timer);
+  delete i->cb;
+  i->cb = cb->IsFunction() ? new Callback(cb.As<Function>()) : NULL;
+  i->ms = i->cb ? ms : 0;
+  i->active = uv_now(uv_default_loop());
+  i->timer.fire = idle_fire;
+  if (i->ms)
+    wheel_add(&i->timer, i->ms);
+}
+
+static void idle_free(struct idle *i) {
+  wheel_cancel(&i->timer);
+  delete i->cb;
+  i->cb = NULL;
+}